@@ -0,0 +1,318 @@
+// Fixed benchmark over the built-in scenes. Every run uses the same seed, resolution and sample count,
+// so numbers from different commits can be compared directly. Results are printed as a table
+// and written as JSON for tracking regressions.
+
+#include "general.h"
+#include "hittablelist.h"
+#include "camera.h"
+#include "bvh.h"
+#include "scenes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+struct benchmark_case {
+	std::string scene;
+	int width;
+	int spp;
+	int depth;
+};
+
+struct benchmark_result {
+	benchmark_case setup;
+	bool ok = false;
+	std::string error;
+	int height = 0;
+	double scene_seconds = 0;
+	double bvh_seconds = 0; //top level over the scene's objects
+	double mesh_bvh_seconds = 0; //of the meshes, built while the scene loads
+	double render_seconds = 0; //best of the runs
+	uint64_t primary_rays = 0;
+	uint64_t total_rays = 0;
+	double peak_memory_mb = 0; //of the process after the case, includes the peaks of the cases before it
+	double peak_growth_mb = 0; //how far the case raised the process peak, 0 if an earlier case peaked higher
+};
+
+//peak resident memory of the whole process so far
+static double peak_memory_mb()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+	return 0;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+//sums the BVH build times of the meshes in the scene, each mesh once however often it is instanced
+static double mesh_build_seconds(const shared_ptr<hittable>& object, std::set<const hittable*>& counted)
+{
+	if (!counted.insert(object.get()).second)
+		return 0;
+	if (auto mesh = std::dynamic_pointer_cast<triangle_mesh>(object))
+		return mesh->build_time();
+	if (auto inst = std::dynamic_pointer_cast<instance>(object))
+		return mesh_build_seconds(inst->object(), counted);
+	return 0;
+}
+
+static std::string json_string(const std::string& text)
+{
+	std::string out = "\"";
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\') { out += '\\'; out += c; }
+		else if (c == '\n') out += "\\n";
+		else if ((unsigned char)c < 0x20) out += ' ';
+		else out += c;
+	}
+	return out + "\"";
+}
+
+static benchmark_result run_case(const benchmark_case& setup, int threads, int runs)
+{
+	using clock = std::chrono::steady_clock;
+	auto seconds_since = [](clock::time_point start) {
+		return std::chrono::duration<double>(clock::now() - start).count();
+	};
+
+	benchmark_result result;
+	result.setup = setup;
+	const double peak_before = peak_memory_mb();
+
+	camera cam;
+	default_camera(cam);
+	cam.multithreading = threads > 0;
+	cam.threadsize = threads > 0 ? threads : 1;
+
+	hittable_list world;
+	auto scene_start = clock::now();
+	try
+	{
+		if (!load_scene(setup.scene, world, cam))
+		{
+			result.error = "unknown scene";
+			return result;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		result.error = e.what();
+		return result;
+	}
+	result.scene_seconds = seconds_since(scene_start);
+	std::set<const hittable*> counted;
+	for (auto& object : world.objects)
+	{
+		result.mesh_bvh_seconds += mesh_build_seconds(object, counted);
+	}
+
+	//fixed settings so the scene's own defaults do not change the workload between commits
+	cam.image_width = setup.width;
+	cam.samples_per_pixel = setup.spp;
+	cam.max_depth = setup.depth;
+	cam.seedMultiplier = 97531;
+
+	auto world_root = make_shared<bvh_node>(world, &cam.workers());
+	hittable_list world_bvh(world_root);
+	result.bvh_seconds = world_root->build_time();
+
+	cam.initialize();
+	result.height = cam.image_height;
+
+	result.render_seconds = infinity;
+	for (int run = 0; run < runs; run++)
+	{
+		cam.stats->reset();
+		auto render_start = clock::now();
+		//one pass with every sample, so each tile task traces all of its samples at once
+		cam.reset_accumulation();
+		cam.samples_per_pass = cam.samples_per_pixel;
+		cam.render(world_bvh);
+		result.render_seconds = std::min(result.render_seconds, seconds_since(render_start));
+	}
+	result.primary_rays = cam.stats->primary_rays;
+	result.total_rays = cam.stats->total_rays;
+	result.peak_memory_mb = peak_memory_mb();
+	result.peak_growth_mb = result.peak_memory_mb - peak_before;
+	result.ok = true;
+	return result;
+}
+
+static void write_json(std::ostream& out, const std::vector<benchmark_result>& results, int threads, int runs, const std::string& label)
+{
+	out << std::setprecision(6);
+	out << "{\n";
+	out << "  \"label\": " << json_string(label) << ",\n";
+	out << "  \"threads\": " << threads << ",\n";
+	out << "  \"bvh\": " << json_string(bvh_layout_name(bvh_tree::default_layout)) << ",\n";
+	out << "  \"runs\": " << runs << ",\n";
+	out << "  \"scenes\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		auto& r = results[i];
+		out << "    {\n";
+		out << "      \"scene\": " << json_string(r.setup.scene) << ",\n";
+		out << "      \"ok\": " << (r.ok ? "true" : "false") << ",\n";
+		if (!r.ok)
+		{
+			out << "      \"error\": " << json_string(r.error) << "\n";
+		}
+		else
+		{
+			out << "      \"width\": " << r.setup.width << ",\n";
+			out << "      \"height\": " << r.height << ",\n";
+			out << "      \"spp\": " << r.setup.spp << ",\n";
+			out << "      \"max_depth\": " << r.setup.depth << ",\n";
+			out << "      \"scene_seconds\": " << r.scene_seconds << ",\n";
+			out << "      \"bvh_build_seconds\": " << r.bvh_seconds << ",\n";
+			out << "      \"mesh_bvh_build_seconds\": " << r.mesh_bvh_seconds << ",\n";
+			out << "      \"render_seconds\": " << r.render_seconds << ",\n";
+			out << "      \"primary_rays\": " << r.primary_rays << ",\n";
+			out << "      \"total_rays\": " << r.total_rays << ",\n";
+			out << "      \"primary_rays_per_second\": " << r.primary_rays / r.render_seconds << ",\n";
+			out << "      \"total_rays_per_second\": " << r.total_rays / r.render_seconds << ",\n";
+			out << "      \"process_peak_memory_mb\": " << r.peak_memory_mb << ",\n";
+			out << "      \"peak_memory_growth_mb\": " << r.peak_growth_mb << "\n";
+		}
+		out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
+
+static void print_usage(const char* program)
+{
+	std::cout << "usage: " << program << " [options]\n"
+		<< "  --scene <name>   only run this scene, can be repeated (all); a single scene gives its own memory peak\n"
+		<< "  --threads <n>    worker threads, 0 renders on the calling thread (hardware threads)\n"
+		<< "  --runs <n>       renders per scene, the fastest is reported (3)\n"
+		<< "  --scale <f>      multiplies every width, for quick runs (1)\n"
+		<< "  --bvh <binary|bvh4|bvh8>  BVH layout of the scenes and meshes\n"
+		<< "  --label <text>   stored in the JSON, e.g. the commit being measured\n"
+		<< "  --json <path>    output file (benchmark.json)\n";
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<benchmark_case> cases = {
+		{ "normal", 640, 16, 5 },
+		{ "normal2", 640, 16, 5 },
+		{ "cornell", 400, 32, 10 },
+		{ "triangle", 640, 8, 5 },
+	};
+
+	//meshes are always parsed and built, a cache left by an earlier run would skip both
+	use_mesh_cache = false;
+
+	int threads = (int)std::thread::hardware_concurrency();
+	int runs = 3;
+	double scale = 1;
+	std::string label;
+	std::string json_path = "benchmark.json";
+	std::vector<std::string> only;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h" || i + 1 >= argc)
+		{
+			print_usage(argv[0]);
+			return arg == "--help" || arg == "-h" ? 0 : 1;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "--scene") only.push_back(value);
+		else if (arg == "--threads") threads = std::atoi(value.c_str());
+		else if (arg == "--runs") runs = std::max(1, std::atoi(value.c_str()));
+		else if (arg == "--scale") scale = std::atof(value.c_str());
+		else if (arg == "--label") label = value;
+		else if (arg == "--bvh")
+		{
+			if (!parse_bvh_layout(value, bvh_tree::default_layout))
+			{
+				std::cout << "unknown BVH layout " << value << "\n";
+				return 1;
+			}
+		}
+		else if (arg == "--json") json_path = value;
+		else
+		{
+			std::cout << "unknown option " << arg << "\n";
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<benchmark_result> results;
+	for (auto setup : cases)
+	{
+		if (!only.empty() && std::find(only.begin(), only.end(), setup.scene) == only.end())
+			continue;
+		setup.width = std::max(1, (int)(setup.width * scale));
+		results.push_back(run_case(setup, threads, runs));
+	}
+
+	std::cout << "\n" << std::left << std::setw(10) << "scene" << std::right
+		<< std::setw(11) << "size" << std::setw(6) << "spp"
+		<< std::setw(11) << "render s" << std::setw(10) << "bvh ms" << std::setw(11) << "mesh ms"
+		<< std::setw(13) << "primary M/s" << std::setw(11) << "total M/s"
+		<< std::setw(14) << "proc peak MB" << std::setw(10) << "+peak MB" << "\n";
+	for (auto& r : results)
+	{
+		std::cout << std::left << std::setw(10) << r.setup.scene << std::right;
+		if (!r.ok)
+		{
+			std::cout << "  failed: " << r.error << "\n";
+			continue;
+		}
+		std::ostringstream size;
+		size << r.setup.width << "x" << r.height;
+		std::cout << std::fixed << std::setprecision(3)
+			<< std::setw(11) << size.str() << std::setw(6) << r.setup.spp
+			<< std::setw(11) << r.render_seconds << std::setw(10) << r.bvh_seconds * 1000 << std::setw(11) << r.mesh_bvh_seconds * 1000
+			<< std::setw(13) << r.primary_rays / r.render_seconds / 1e6
+			<< std::setw(11) << r.total_rays / r.render_seconds / 1e6
+			<< std::setw(14) << std::setprecision(1) << r.peak_memory_mb << std::setw(10) << r.peak_growth_mb << "\n";
+		std::cout.unsetf(std::ios::fixed);
+	}
+
+	std::ofstream json(json_path);
+	if (!json)
+	{
+		std::cout << "failed writing " << json_path << "\n";
+		return 1;
+	}
+	write_json(json, results, threads, runs, label);
+	std::cout << "wrote " << json_path << "\n";
+
+	bool all_ok = std::all_of(results.begin(), results.end(), [](const benchmark_result& r) { return r.ok; });
+	return all_ok ? 0 : 2;
+}
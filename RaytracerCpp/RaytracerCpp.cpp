@@ -9,17 +9,20 @@
 #include "instance.h"
 #include "triangle.h"
 #include "objimporter.h"
+#include "scenes.h"
+#include "denoiser.h"
+#include "tonemap.h"
+#include "rendercontroller.h"
 
 #include "glad/gl.h"
 #include <GLFW/glfw3.h>
+#include "previewtexture.h"
 
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
 
 
-#include"external/OpenImageDenoise/oidn.hpp"
-
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "external/stb_image_write.h"
 
@@ -30,15 +33,14 @@
 #include <iomanip>
 #include <chrono>
 #include <ctime>
+#include <algorithm>
 
 
-void RenderWorld(camera& cam, hittable_list& world, float*& pixels, int& sample);
-void NormalScene( hittable_list& world,  camera& cam);
-void NormalScene2(hittable_list& world, camera& cam);
-void cornell_box(hittable_list& world, camera& cam);
-void Triangle(hittable_list& world, camera& cam);
-void denoise(const camera& cam, float*& pixels);
-void UpdateTexture(const camera& cam, float*& pixels);
+void ReceiveTiles(render_controller& renderer, float*& pixels);
+void denoise(render_controller& renderer, float*& pixels);
+void present(float*& pixels);
+void present(float*& pixels, const std::vector<tile_rect>& regions);
+void UpdateTexture(float*& pixels, const std::vector<tile_rect>& regions);
 
 std::string getCurrentDateTimeFilename(std::string extension) {
 	auto now = std::chrono::system_clock::now();
@@ -88,25 +90,23 @@ const char* fragmentShaderSource = "#version 330 core\n"
 "    FragColor.a = 1;\n"
 "} ";
 
-static double lasttime = 0;
+static double bvh_build_time = 0;
 static bool bvh_world = true;
+static bool denoise_guided = true; //albedo and normal of the first hits as denoiser inputs
+static bool denoise_finished = false; //denoise once the render reached its samples
+static std::vector<float> radiance; //linear image behind the display buffer, as the render thread sent it
+static std::vector<float> denoised; //denoised copy of radiance, shown until the next tile arrives
+static bool showing_denoised = false;
+static tonemap_settings display_settings;
+static std::unique_ptr<preview_texture> preview;
+static preview_format display_format = preview_format::rgba8;
+static double upload_time = 0;
+static int display_width = 0, display_height = 0; //of the image shown, the camera settings may already differ
 int main()
 {
 	//camera setup
 	camera cam;
-	cam.aspect_ratio = 16.0 / 9.0;
-	cam.image_width = 800;
-	cam.samples_per_pixel = 50;
-	cam.max_depth = 5;
-
-	cam.lookfrom = point3(0,1,2);
-	cam.lookat = point3(0, 0, -1);
-	cam.vup = point3(0, 1, 0);
-	cam.vertical_fov = 90;
-	cam.defocus_angle = 0;
-	cam.focus_dist = 1;
-	cam.background = make_shared<image_texture>("photo.jpg");
-	cam.threadsize = 20;
+	default_camera(cam);
 
 	mat3 maty = mat3::identity();
 	
@@ -200,19 +200,15 @@ int main()
 	Triangle(world,  cam);
 	//NormalScene2(world,  cam);
 	//cornell_box(world,  cam);
-	world_bvh = hittable_list(make_shared<bvh_node>(world));
+	auto world_root = make_shared<bvh_node>(world, &cam.workers());
+	bvh_build_time = world_root->build_time();
+	world_bvh = hittable_list(world_root);
 	
+	//renders on its own thread, declared after the worlds so it stops before they are destroyed
+	render_controller renderer;
 
 	//texture init
-	GLuint image_texture;
-	glGenTextures(1, &image_texture);
-	glBindTexture(GL_TEXTURE_2D, image_texture);
-
-	// Setup filtering parameters for display
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); 
+	preview = std::make_unique<preview_texture>((GLADloadfunc)glfwGetProcAddress);
 
 	float* buffer = nullptr;
 	while (!glfwWindowShouldClose(window))
@@ -226,47 +222,86 @@ int main()
 		static float f = 0.0f;
 		static int counter = 0;
 		static bool continious = false;
-		static int sample = 0;
+		static bool restart = false; //settings changed since the image was started
 		
 
 		ImGui::Begin("Render Settings");
 		ImGui::Text("Raytracing Settings");
 
-		ImGui::InputInt("Samples Per Pixel", &cam.samples_per_pixel);
-		ImGui::InputInt("Bounches", &cam.max_depth);
+		restart |= ImGui::InputInt("Samples Per Pixel", &cam.samples_per_pixel);
+		restart |= ImGui::InputInt("Samples Per Pass", &cam.samples_per_pass);
+		restart |= ImGui::Checkbox("Adaptive sampling", &cam.adaptive_sampling);
+		if (cam.adaptive_sampling)
+		{
+			ImGui::SameLine();
+			ImGui::PushItemWidth(100);
+			restart |= ImGui::InputDouble("Noise threshold", &cam.adaptive_threshold);
+			ImGui::PopItemWidth();
+		}
+		restart |= ImGui::InputInt("Bounches", &cam.max_depth);
+		restart |= ImGui::Checkbox("Russian roulette", &cam.russian_roulette);
+		ImGui::SameLine();
+		restart |= ImGui::Checkbox("Light sampling", &cam.light_sampling);
 
 		ImGui::Text("Camera Settings");
-		ImGui::InputDouble("Aspect ratio", &cam.aspect_ratio);
-		ImGui::InputInt("Camera Width", &cam.image_width);
-		ImGui::InputInt("vertical FOV", &cam.vertical_fov);
-		ImGui::InputDouble("focus distance", &cam.focus_dist);
-		ImGui::InputDouble("defocus angle", &cam.defocus_angle);
+		restart |= ImGui::InputDouble("Aspect ratio", &cam.aspect_ratio);
+		restart |= ImGui::InputInt("Camera Width", &cam.image_width);
+		restart |= ImGui::InputInt("vertical FOV", &cam.vertical_fov);
+		restart |= ImGui::InputDouble("focus distance", &cam.focus_dist);
+		restart |= ImGui::InputDouble("defocus angle", &cam.defocus_angle);
 
 		ImGui::Text("Camera Position");
 		ImGui::PushItemWidth(100);
-		ImGui::InputDouble("Cx", &cam.lookfrom[0]);ImGui::SameLine();
-		ImGui::InputDouble("Cy", &cam.lookfrom[1]);ImGui::SameLine();
-		ImGui::InputDouble("Cz", &cam.lookfrom[2]);
+		restart |= ImGui::InputDouble("Cx", &cam.lookfrom[0]);ImGui::SameLine();
+		restart |= ImGui::InputDouble("Cy", &cam.lookfrom[1]);ImGui::SameLine();
+		restart |= ImGui::InputDouble("Cz", &cam.lookfrom[2]);
 
 		ImGui::Text("Look at");
-		ImGui::InputDouble("Lx", &cam.lookat[0]);ImGui::SameLine();
-		ImGui::InputDouble("Ly", &cam.lookat[1]);ImGui::SameLine();
-		ImGui::InputDouble("Lz", &cam.lookat[2]);
+		restart |= ImGui::InputDouble("Lx", &cam.lookat[0]);ImGui::SameLine();
+		restart |= ImGui::InputDouble("Ly", &cam.lookat[1]);ImGui::SameLine();
+		restart |= ImGui::InputDouble("Lz", &cam.lookat[2]);
 		ImGui::PopItemWidth();
 
-		if (ImGui::Button("Render")) {			
-			sample = 0;
+		//in realtime mode a changed setting restarts the image
+		if (ImGui::Button("Render") || (continious && restart && renderer.current_generation() > 0)) {
+			restart = false;
 			glfwSetWindowAspectRatio(window, cam.aspect_ratio * 100, 100);
-			RenderWorld(cam, bvh_world?world_bvh: world,buffer,sample);
+			renderer.start(cam, bvh_world ? world_bvh : world);
 		}
-		else if (continious && sample < cam.samples_per_pixel && sample>0)
+		if (renderer.rendering())
 		{
-			RenderWorld(cam, bvh_world ? world_bvh : world, buffer, sample);
+			ImGui::SameLine();
+			if (ImGui::Button("Pause")) renderer.pause();
+		}
+		else if (renderer.is_paused())
+		{
+			ImGui::SameLine();
+			if (ImGui::Button("Resume")) renderer.resume();
 		}
-		if (sample > 0)
+		if (renderer.rendering() || renderer.is_paused())
 		{
 			ImGui::SameLine();
-			ImGui::Text(" %i / %i", sample, cam.samples_per_pixel);
+			if (ImGui::Button("Cancel")) renderer.cancel();
+		}
+
+		//read before the queue is drained, every tile of a finished image is queued by then
+		static uint64_t denoised_generation = 0;
+		const bool finished = renderer.finished();
+		ReceiveTiles(renderer, buffer);
+		if (finished && denoise_finished && denoised_generation != renderer.current_generation())
+		{
+			denoised_generation = renderer.current_generation();
+			denoise(renderer, buffer);
+		}
+		if (renderer.current_generation() > 0)
+		{
+			ImGui::SameLine();
+			ImGui::Text(" %i / %i", renderer.samples(), cam.samples_per_pixel);
+			if (cam.adaptive_sampling)
+			{
+				ImGui::SameLine();
+				ImGui::Text(" %.0f%% converged", renderer.converged_fraction() * 100);
+			}
 		}
 		
 		ImGui::Checkbox("Multithreading", &cam.multithreading);
@@ -283,27 +318,69 @@ int main()
 				ImGui::PushItemWidth(100);
 				ImGui::InputInt("tile Count", &cam.tilesize);
 				ImGui::PopItemWidth();
+				ImGui::Checkbox("Packet tracing", &cam.packet_tracing);
 			}
 		}	
-		ImGui::Checkbox("BVH?", &bvh_world);
+		restart |= ImGui::Checkbox("BVH?", &bvh_world);
+		ImGui::SameLine();
+		ImGui::PushItemWidth(100);
+		static int layout = (int)bvh_tree::default_layout;
+		const char* layouts[] = { "binary", "bvh4", "bvh8" };
+		if (ImGui::Combo("Layout", &layout, layouts, 3))
+		{
+			//only the top level is rebuilt, meshes keep the layout they were loaded with
+			renderer.cancel();
+			restart = true;
+			bvh_tree::default_layout = (bvh_layout)layout;
+			world_root = make_shared<bvh_node>(world, &cam.workers());
+			bvh_build_time = world_root->build_time();
+			world_bvh = hittable_list(world_root);
+		}
+		ImGui::PopItemWidth();
 		ImGui::SameLine();
 		ImGui::Checkbox("Realtime", &continious);
+
+		ImGui::Text("Display");
+		ImGui::PushItemWidth(100);
+		bool display_changed = ImGui::SliderFloat("Exposure", &display_settings.exposure, -8.0f, 8.0f, "%.1f stops");
+		ImGui::SameLine();
+		int tonemapper = (int)display_settings.op;
+		const char* tonemappers[] = { "Clamp", "Reinhard", "ACES" };
+		if (ImGui::Combo("Tone mapping", &tonemapper, tonemappers, 3))
+		{
+			display_settings.op = (tonemap_operator)tonemapper;
+			display_changed = true;
+		}
+		int format = (int)display_format;
+		const char* formats[] = { "8 bit", "Half float", "Float" };
+		if (ImGui::Combo("Preview", &format, formats, 3))
+		{
+			display_format = (preview_format)format;
+			display_changed = true;
+		}
+		ImGui::PopItemWidth();
+		if (display_changed && buffer != nullptr)
+			present(buffer);
+
 		if (buffer != nullptr)
 		{
+			//only between passes, the guides are read from the render camera and would wait for the pass
+			ImGui::BeginDisabled(!renderer.idle());
 			if (ImGui::Button("Denoise")) {
-				denoise(cam, buffer);
+				denoise(renderer, buffer);
 			}
+			ImGui::EndDisabled();
+			ImGui::SameLine();
+			ImGui::Checkbox("Albedo/normal", &denoise_guided);
+			ImGui::SameLine();
+			ImGui::Checkbox("When done", &denoise_finished);
 			ImGui::SameLine();
 			if (ImGui::Button("Save")) {
 
-				unsigned char* data = new unsigned char[cam.image_width * cam.image_height * 3];
-
-				for (int i = 0;i < cam.image_width * cam.image_height * 3;i++)
-				{
-					data[i] = static_cast<unsigned char>(std::round(buffer[i] * 255.0));
-				}
+				unsigned char* data = new unsigned char[display_width * display_height * 3];
+				quantize(buffer, data, (size_t)display_width * display_height * 3);
 				std::string filename = getCurrentDateTimeFilename(".png");
-				stbi_write_png(filename.c_str(), cam.image_width, cam.image_height, 3, data, cam.image_width * 3);
+				stbi_write_png(filename.c_str(), display_width, display_height, 3, data, display_width * 3);
 
 				delete[] data;
 			}		
@@ -311,7 +388,10 @@ int main()
 		}
 
 
-		ImGui::Text("Last render time %.3f seconds", (float)lasttime);
+		ImGui::Text("Last pass time %.3f seconds", (float)renderer.last_pass_time());
+		ImGui::Text("Rays %.2f M/s", (float)(renderer.rays_per_second() / 1e6));
+		ImGui::Text("BVH build time %.3f ms", (float)(bvh_build_time * 1000));
+		ImGui::Text("Preview upload %.3f ms", (float)(upload_time * 1000));
 		ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / io.Framerate, io.Framerate);
 		ImGui::End();
 		
@@ -325,7 +405,7 @@ int main()
 		glClear(GL_COLOR_BUFFER_BIT);
 
 		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, image_texture);
+		glBindTexture(GL_TEXTURE_2D, preview->id());
 		glUseProgram(shaderProgram);
 		glUniform1i(glGetUniformLocation(shaderProgram, "FrameTexture"), 0);
 		glBindVertexArray(VAO);		
@@ -337,6 +417,7 @@ int main()
 		glfwSwapBuffers(window);
 	}	
 
+	preview.reset();
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
@@ -347,210 +428,105 @@ int main()
 	return 0;	
 }
 
-void denoise(const camera& cam, float*& pixels)
+void denoise(render_controller& renderer, float*& pixels)
 {
-	int width = cam.image_width;
-	int height = cam.image_height;
-
-	oidn::DeviceRef device = oidn::newDevice(); // CPU or GPU if available
-	device.commit();
-	oidn::BufferRef colorBuf = device.newBuffer(width * height * 3 * sizeof(float));
-	oidn::FilterRef filter = device.newFilter("RT"); // generic ray tracing filter
-	filter.setImage("color", colorBuf, oidn::Format::Float3, width, height); // beauty
-	filter.setImage("output", colorBuf, oidn::Format::Float3, width, height);
-	filter.commit();
-	float* colorPtr = (float*)colorBuf.getData();
-	for (int i = 0; i < width * height * 3; i++)
+	//the filter and its buffers are kept for the next denoise of the same size
+	static denoiser filter;
+	static std::vector<float> albedo, normal;
+
+	int width = display_width;
+	int height = display_height;
+	if (radiance.size() != (size_t)width * height * 3 || !renderer.idle())
+		return;
+	if (denoise_guided)
 	{
-		colorPtr[i] = pixels[i];
+		albedo.resize((size_t)width * height * 3);
+		normal.resize((size_t)width * height * 3);
+		bool resolved = false;
+		renderer.inspect([&](const camera& image) {
+			if (image.aovs().width() != width || image.aovs().height() != height) return;
+			image.resolve_first_hits(albedo.data(), normal.data());
+			resolved = true;
+		});
+		if (!resolved)
+			return;
 	}
-	filter.execute();
 
-	const char* errorMessage;
-	if (device.getError(errorMessage) != oidn::Error::None)
-		std::cout << "Error: " << errorMessage << std::endl;
-	else
+	double starttime = glfwGetTime();
+	denoised.resize(radiance.size());
+	if (filter.run(radiance.data(), denoise_guided ? albedo.data() : nullptr, denoise_guided ? normal.data() : nullptr, denoised.data(), width, height))
 	{
-		for (int i = 0; i < width * height * 3; i++)
-		{
-			pixels[i] = colorPtr[i];
-		}
-		UpdateTexture(cam, pixels);
+		std::cout << "Denoised in " << (glfwGetTime() - starttime) * 1000 << " ms\n";
+		showing_denoised = true;
+		present(pixels);
 	}
-
 }
 
-void UpdateTexture(const camera& cam, float*& pixels)
+//tone maps the linear image into the display buffer and uploads it
+void present(float*& pixels)
 {
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cam.image_width, cam.image_height, 0, GL_RGB, GL_FLOAT, pixels);
+	present(pixels, { { 0, 0, display_width, display_height } });
 }
 
-void RenderWorld(camera& cam, hittable_list& world, float*& pixels,int& sample)
-{	
-	int starttime = glfwGetTime();
-	cam.seedMultiplier = glfwGetTime();
-	cam.render(world);
-	lasttime = glfwGetTime() - starttime;
-
-	if (sample == 0)
-	{
-		if (pixels != nullptr)
-			free(pixels);
-		pixels = (float*)malloc((cam.image_width * cam.image_height) * 3 * sizeof(float));
-	}
-
-	
-	int c = 0;
-
-	for (int i=0;i<cam.image_width*cam.image_height;i++)
+//same for the regions that changed
+void present(float*& pixels, const std::vector<tile_rect>& regions)
+{
+	for (const tile_rect& r : regions)
 	{
-		auto& pixel = cam.pixelarray[i];		
-		pixels[c] = ((pixels[c] * sample) + (float)(pixel[0])) / (sample + 1);
-		pixels[c + 1] = ((pixels[c + 1] * sample) + (float)(pixel[1])) / (sample + 1);
-		pixels[c + 2] = ((pixels[c + 2] * sample) + (float)(pixel[2])) / (sample + 1);
-		
-		c += 3;
-		
+		for (int y = r.y; y < r.y + r.height; y++)
+		{
+			size_t offset = ((size_t)y * display_width + r.x) * 3;
+			tonemap((showing_denoised ? denoised : radiance).data() + offset, pixels + offset, (size_t)r.width * 3, display_settings);
+		}
 	}
-
-	sample++;
-
-	UpdateTexture(cam, pixels);
-	
+	UpdateTexture(pixels, regions);
 }
 
-void NormalScene(hittable_list& world, camera& cam)
+void UpdateTexture(float*& pixels, const std::vector<tile_rect>& regions)
 {
-	//material setup
-	auto mat_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-	auto mat_red = make_shared<lambertian>(make_shared<image_texture>("photous.jpg"));
-	auto mat_glass = make_shared<dielectric>(1.5);
-	auto mat_chrome = make_shared<metal>(color(0.8, 0.8, 0.8), 0.1);
-	auto mat_gold = make_shared<metal>(color(0.8, 0.6, 0.2), 0.2);
-	auto red = make_shared<diffuse_light>(color(0.5, 0, 0));
-
-	cam.background = make_shared<solid_color>(color(0.5, 0.5, 0.5));
-
-	//world.add(make_shared<sphere>(color(1, 0, -1), 0.5, mat_gold));
-	world.add(make_shared<sphere>(color(0, 0, -1), 0.5, red));
-	/*world.add(make_shared<sphere>(color(-1, 0, -1), 0.5, mat_glass));
-	world.add(make_shared<sphere>(color(-1, 0, -1), -0.4, mat_glass));*/
-	world.add(make_shared<sphere>(color(0, -100.5, -1), 100, mat_ground));
-	//world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 1, 0), vec3(1, 0, 0), red));
-	
+	double starttime = glfwGetTime();
+	preview->upload(pixels, display_width, display_height, display_format, regions);
+	upload_time = glfwGetTime() - starttime;
 }
 
-void NormalScene2(hittable_list& world, camera& cam)
+//copies the tiles the render thread finished since the last frame into the image and presents them
+void ReceiveTiles(render_controller& renderer, float*& pixels)
 {
-	//material setup
-	auto mat_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-	auto mat_red = make_shared<lambertian>(make_shared<image_texture>("photobaba.jpg"));
-	auto mat_baba_light = make_shared<diffuse_light>(make_shared<image_texture>("photobaba.jpg"));
-	auto mat_glass = make_shared<dielectric>(1.5);
-	auto mat_chrome = make_shared<metal>(color(0.8, 0.8, 0.8), 0.1);
-	auto mat_gold = make_shared<metal>(color(0.8, 0.6, 0.2), 0.2);
-	auto red = make_shared<diffuse_light>(color(0.5, 0, 0));
-
-	cam.background = make_shared<solid_color>(color(0.01, 0.01, 0.01));
-
-	world.add(make_shared<sphere>(vec3(1.5, 0, -1), 0.5, mat_gold));
-	auto middle = make_shared<sphere>(vec3(0, 0, 0), 0.5, mat_red);
-	auto baba = make_shared<quad>(vec3(-5, 2, -5),  vec3(10, 0, 0), vec3(0, 5, 0), mat_baba_light);
-
-	world.add(baba);
-	
-	for (int i = 0;i < 100;i++)
+	static tile_update update;
+	static std::vector<tile_rect> regions;
+	regions.clear();
+	bool resized = false;
+	while (renderer.poll(update))
 	{
-		//world.add(make_shared<sphere>(vec3(random_double(-10, 10), 0, random_double(-10, 10)), 0.5, mat_red));
-		world.add(make_shared<instance>(middle, vec3(random_double(-10,10),0, random_double(-10, 10)), vec3(0, random_double(0,2*pi), 0)));
-	}	
-	world.add(make_shared<quad>(vec3(-100, -0.5, -100), vec3(0, 0, 200), vec3(200, 0, 0), mat_ground));
-	
-
-	cam.lookfrom = point3(1, 2, 3);
-	cam.lookat = point3(0, 2, -1);
-	cam.samples_per_pixel = 100;
-	cam.max_depth = 20;
-	
-}
+		//the display buffer is only reallocated when the resolution changes
+		if (update.image_width != display_width || update.image_height != display_height)
+		{
+			display_width = update.image_width;
+			display_height = update.image_height;
+			size_t size = (size_t)display_width * display_height * 3;
+			if (pixels != nullptr)
+				free(pixels);
+			pixels = (float*)malloc(size * sizeof(float));
+			radiance.assign(size, 0.0f);
+			resized = true;
+		}
 
-void Triangle(hittable_list& world, camera& cam) {
-	//auto mat_red = make_shared<lambertian>(make_shared<image_texture>("photobaba.jpg"));
-	
-	/*auto v0 = make_shared<vertex>();
-	auto v1 = make_shared<vertex>();
-	auto v2 = make_shared<vertex>();
-	v0->position = vec3(0, 0, 0);
-	v0->u = 0;
-	v0->v = 0;
-
-	v1->position = vec3(0, 1, 0);
-	v1->u = 0;
-	v1->v = 1;
-
-	v2->position = vec3(1, 0, 0);
-	v2->u = 1;
-	v2->v = 0;
-
-	auto tri = make_shared<triangle>(v0,v1,v2, mat_gold);*/
-	//world.add(tri);
-	auto mat_gold = make_shared<metal>(color(0.8, 0.6, 0.2), 0.2);
-	auto mat_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-	//auto three_model = make_shared<bvh_node>(*LoadMesh("bidu.obj", mat_gold));	
-	auto whitelight = make_shared<diffuse_light>(color(15, 15, 15));
-
-	auto metildamat = make_shared<lambertian>(make_shared<image_texture>("matilda.jpg"));
-	auto matilda = make_shared<bvh_node>(*LoadMesh("matilda.obj", metildamat));
-	auto light = make_shared<quad>(vec3(0, 0, 0), vec3(0, 1, 0), vec3(0, 0, 0.5), whitelight);
-	
-	world.add( make_shared<instance>(light,vec3(-1,0.5,0),vec3(0, pi / 4,0)));
-	
-	
-	world.add(make_shared<instance>(matilda, vec3(0, -0.5, 0), vec3(0, 0, 0)));
-	
-	/*world.add(make_shared<instance>(matilda, vec3(-1, -0.5, 0), vec3(0, pi / 2, 0)));
-	world.add(make_shared<instance>(matilda, vec3(1, -0.5, -1), vec3(0, pi / 2, 0)));
-	world.add(make_shared<instance>(matilda, vec3(0, -0.5, 1), vec3(0, 0, 0)));*/
-	/*world.add(three_model);
-	world.add( make_shared<instance>(three_model,vec3(1,0,1),vec3(0,pi/2,0)));
-	world.add(make_shared<instance>(three_model, vec3(-1, 0, 1), vec3(0, -pi / 2, 0)));*/
-	
-	world.add(make_shared<quad>(vec3(-100, -0.5, -100), vec3(0, 0, 200), vec3(200, 0, 0), mat_ground));
-	//cam.background = make_shared<solid_color>(vec3(0.5, 0.5, 0.5));
-	//cam.background = make_shared<solid_color>(0.01,0.01,0.05);
-	cam.lookat=vec3(0, 1.2, 0);
-	cam.vertical_fov = 50;
-	cam.image_width = 1920;
+		const tile_rect& r = update.rect;
+		for (int y = 0; y < r.height; y++)
+		{
+			std::copy_n(update.pixels.data() + (size_t)y * r.width * 3, (size_t)r.width * 3, radiance.data() + ((size_t)(r.y + y) * display_width + r.x) * 3);
+		}
+		regions.push_back(r);
+	}
 
+	//new tiles are noisy, the whole image goes back to the render's so it never mixes with denoised tiles
+	if (!regions.empty() && showing_denoised)
+	{
+		showing_denoised = false;
+		resized = true;
+	}
+	if (resized)
+		present(pixels);
+	else if (!regions.empty())
+		present(pixels, regions);
 }
-
-void cornell_box(hittable_list& world, camera& cam) {
-	
-
-	auto red = make_shared<lambertian>(color(.65, .05, .05));
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
-	auto green = make_shared<lambertian>(color(.12, .45, .15));
-	auto light = make_shared<diffuse_light>(color(15, 15, 15));
-
-	world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
-	world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
-	world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
-	world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
-	world.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
-	world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
-
-	cam.aspect_ratio = 1.0;
-	cam.image_width = 600;
-	cam.samples_per_pixel = 200;
-	cam.max_depth = 50;
-	cam.background = make_shared<solid_color>(color(0, 0, 0));
-
-	cam.vertical_fov = 40;
-	cam.lookfrom = point3(278, 278, -800);
-	cam.lookat = point3(278, 278, 0);
-	cam.vup = vec3(0, 1, 0);
-
-	cam.defocus_angle = 0;
-
-	
-}
\ No newline at end of file
@@ -3,7 +3,7 @@
 #include<vector>
 
 #include "general.h"
-#include "mat4.h"
+#include "mat3x4.h"
 
 class aabb {
 public:
@@ -34,36 +34,26 @@ public:
 		return x;
 	}
 
-	aabb transform(mat4 transform) {
-		std::vector<vec4> list;
-
-		list.push_back(vec4(x.min, y.min, z.min, 1));
-		list.push_back(vec4(x.max, y.min, z.min, 1));
-		list.push_back(vec4(x.min, y.max, z.min, 1));		
-		list.push_back(vec4(x.max, y.max, z.min, 1));
-		list.push_back(vec4(x.min, y.min, z.max, 1));
-		list.push_back(vec4(x.max, y.min, z.max, 1));
-		list.push_back(vec4(x.min, y.max, z.max, 1));
-		list.push_back(vec4(x.max, y.max, z.max, 1));
-		
-		vec3 min;
-		vec3 max;
-
-		for (auto& point : list )
-		{
-			point = transform * point;			
-
-			min[0] = fmin(min[0], point[0]);
-			min[1] = fmin(min[1], point[1]);
-			min[2] = fmin(min[2], point[2]);
+	//bounds of the eight transformed corners
+	aabb transform(const mat3x4& transform) const {
+		vec3 min(infinity, infinity, infinity);
+		vec3 max(-infinity, -infinity, -infinity);
 
-			max[0] = fmax(max[0], point[0]);
-			max[1] = fmax(max[1], point[1]);
-			max[2] = fmax(max[2], point[2]);
+		for (int corner = 0; corner < 8; corner++)
+		{
+			vec3 point = transform.point(vec3(
+				corner & 1 ? x.max : x.min,
+				corner & 2 ? y.max : y.min,
+				corner & 4 ? z.max : z.min));
+
+			for (int a = 0; a < 3; a++)
+			{
+				min[a] = fmin(min[a], point[a]);
+				max[a] = fmax(max[a], point[a]);
+			}
 		}
 
 		return aabb(min, max);
-
 	}
 
 	aabb pad() {
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Bounded multi-producer multi-consumer queue after Dmitry Vyukov's design. Every slot carries a sequence
+// number telling producers and consumers whose turn it is, so push and pop contend on a single compare and
+// swap and never take a lock. Items are swapped in and out, the caller gets the slot's previous contents
+// back, so buffers inside items are reused instead of reallocated.
+template<typename T>
+class bounded_queue {
+public:
+	//capacity is rounded up to a power of two
+	explicit bounded_queue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity) size *= 2;
+		slots = std::vector<slot>(size);
+		mask = size - 1;
+		for (size_t i = 0; i < size; i++)
+		{
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bounded_queue(const bounded_queue&) = delete;
+	bounded_queue& operator=(const bounded_queue&) = delete;
+
+	// Swaps item into the queue, false if it is full.
+	bool try_push(T& item)
+	{
+		size_t position = tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			slot& s = slots[position & mask];
+			size_t sequence = s.sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+			if (difference == 0)
+			{
+				if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					std::swap(s.value, item);
+					s.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+				return false;
+			else
+				position = tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Swaps the oldest item out into item, false if the queue is empty.
+	bool try_pop(T& item)
+	{
+		size_t position = head.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			slot& s = slots[position & mask];
+			size_t sequence = s.sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+			if (difference == 0)
+			{
+				if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					std::swap(s.value, item);
+					s.sequence.store(position + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+				return false;
+			else
+				position = head.load(std::memory_order_relaxed);
+		}
+	}
+
+private:
+	struct slot {
+		std::atomic<size_t> sequence{ 0 };
+		T value;
+	};
+
+	std::vector<slot> slots;
+	size_t mask = 0;
+	//producers and consumers on their own cache lines
+	alignas(64) std::atomic<size_t> tail{ 0 };
+	alignas(64) std::atomic<size_t> head{ 0 };
+};
@@ -4,120 +4,938 @@
 
 #include "hittable.h"
 #include "hittablelist.h"
+#include "threadpool.h"
+#include "simd.h"
 #include <algorithm>
-#include <future>
-#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cfloat>
+#include <cstdint>
+#include <new>
+#include <string>
 
-class bvh_node : public hittable {
+// 32 byte node, children of an interior node are stored next to each other so one index is enough
+struct alignas(32) bvh_linear_node {
+	float bmin[3];
+	uint32_t left_first; //left child for interior nodes, first primitive for leaves
+	float bmax[3];
+	uint32_t count; //0 for interior nodes
+
+	bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(bvh_linear_node) == 32, "bvh_linear_node should fill exactly 32 bytes");
+
+// Allocates on Alignment byte boundaries, a vector only guarantees the alignment of its element type.
+template<typename T, size_t Alignment>
+struct aligned_allocator {
+	typedef T value_type;
+	template<typename U> struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+	aligned_allocator() = default;
+	template<typename U> aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+	T* allocate(size_t count) { return (T*)::operator new(count * sizeof(T), std::align_val_t(Alignment)); }
+	void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+	template<typename U> bool operator==(const aligned_allocator<U, Alignment>&) const { return true; }
+	template<typename U> bool operator!=(const aligned_allocator<U, Alignment>&) const { return false; }
+};
+
+// Node of a 4 or 8 wide BVH, the child bounds are stored per axis so one SIMD test covers every child.
+template<int N>
+struct alignas(64) bvh_wide_node {
+	float bmin[3][N]; //bmin[axis][child], +inf for empty slots
+	float bmax[3][N]; //-inf for empty slots
+	uint32_t child[N]; //child node for interior slots, first primitive for leaves
+	uint32_t count[N]; //primitives of a leaf slot, 0 for interior and empty slots
+};
+
+// Binary nodes are tested two boxes at a time, the wide layouts are collapsed from the binary tree after the build.
+enum class bvh_layout { binary, wide4, wide8 };
+
+inline const char* bvh_layout_name(bvh_layout layout)
+{
+	switch (layout)
+	{
+	case bvh_layout::wide4: return "bvh4";
+	case bvh_layout::wide8: return "bvh8";
+	default: return "binary";
+	}
+}
+
+inline bool parse_bvh_layout(const std::string& name, bvh_layout& layout)
+{
+	if (name == "binary" || name == "bvh2") layout = bvh_layout::binary;
+	else if (name == "bvh4") layout = bvh_layout::wide4;
+	else if (name == "bvh8") layout = bvh_layout::wide8;
+	else return false;
+	return true;
+}
+
+// Flattened BVH over primitive bounding boxes, built with a binned surface area heuristic.
+// It only knows primitive indices, the owner decides what a primitive is.
+class bvh_tree {
 public:
-	bvh_node(const hittable_list& list) {
-		int _count = 0;
-		int* countptr = &_count;
-		*this = bvh_node(list.objects, 0, list.objects.size(), countptr);
-	};
+	std::vector<bvh_linear_node, aligned_allocator<bvh_linear_node, 64>> nodes; //cache line aligned, see build
+	std::vector<uint32_t> indices;
+
+	static const int bin_count = 12;
+	static const int max_depth = 60;
+	static const int stack_size = 64;
+
+	static const uint32_t parallel_binning_size = 1 << 16; //nodes this big bin their primitives in chunks on the pool
+	static const uint32_t parallel_subtree_size = 1 << 12; //subtrees this big are built as separate tasks
+	static const uint32_t chunk_size = 1 << 14;
+
+	std::vector<bvh_wide_node<4>> nodes4;
+	std::vector<bvh_wide_node<8>> nodes8;
+	bvh_layout layout = bvh_layout::binary;
 
-	bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end,int* count) {
-		
-		vector<shared_ptr<hittable>> objs(src_objects.begin() + start, src_objects.begin() + end);
-		
-		start = 0;
-		end = objs.size();
+	//layout used by every tree built afterwards, set before loading a scene.
+	//8 wide only pays off when one AVX instruction covers all 8 children
+#ifdef __AVX__
+	static inline bvh_layout default_layout = bvh_layout::wide8;
+#else
+	static inline bvh_layout default_layout = bvh_layout::binary;
+#endif
 
-		if (objs.size() == 0) return;
+	double build_seconds = 0;
 
-		int axis = random_int(0, 2);
+	// pool is optional, without it the tree is built on the calling thread
+	void build(const std::vector<aabb>& bounds, thread_pool* pool = nullptr)
+	{
+		build(bounds, default_layout, pool);
+	}
+
+	void build(const std::vector<aabb>& bounds, bvh_layout _layout, thread_pool* pool = nullptr)
+	{
+		auto start = std::chrono::steady_clock::now();
+		nodes.clear();
+		nodes4.clear();
+		nodes8.clear();
+		indices.clear();
+		layout = _layout;
+		if (bounds.empty()) return;
 
-		auto comparer = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
+		const uint32_t count = (uint32_t)bounds.size();
+		prims.resize(count);
+		indices.resize(count);
+		parallel_chunks(pool, count, [&](uint32_t first, uint32_t last) {
+			for (uint32_t i = first; i < last; i++)
+			{
+				prims[i] = prim_box(bounds[i]);
+				indices[i] = i;
+			}
+		});
 
-		size_t object_length = end - start;
+		//node 1 stays unused so every sibling pair starts on a 64 byte boundary of the aligned node storage
+		nodes.resize((size_t)count * 2);
+		used_nodes = 2;
 
-		if (object_length == 1)
+		auto& root = nodes[0];
+		root.left_first = 0;
+		root.count = count;
+		update_bounds(0);
+		subdivide(0, 0, pool);
+
+		nodes.resize(used_nodes);
+		nodes.shrink_to_fit();
+		prims.clear();
+		prims.shrink_to_fit();
+
+		root_bounds = bounds_of(nodes[0]);
+		if (layout == bvh_layout::wide4)
+			collapse(0, nodes4);
+		else if (layout == bvh_layout::wide8)
+			collapse(0, nodes8);
+		if (layout != bvh_layout::binary)
 		{
-			left = right = objs[start];
+			nodes.clear();
+			nodes.shrink_to_fit();
 		}
-		else if (object_length == 2)
+		build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	aabb bounding_box() const
+	{
+		return root_bounds;
+	}
+
+	// Takes the nodes and indices of an earlier build as they are, e.g. read back from a mesh cache.
+	// The node vector of _layout and indices must already be filled.
+	void restore(bvh_layout _layout, const aabb& bounds)
+	{
+		layout = _layout;
+		root_bounds = bounds;
+		build_seconds = 0;
+	}
+
+	// Checks a tree that was read from outside, e.g. a mesh cache, before it is traversed: every reachable
+	// child lies behind its parent inside the node array, no path is deeper than the traversal stacks,
+	// leaves stay inside indices and every index names one of primitive_count primitives.
+	bool valid(size_t primitive_count) const
+	{
+		for (uint32_t i : indices)
+		{
+			if (i >= primitive_count) return false;
+		}
+		if (layout == bvh_layout::wide4)
+			return valid_wide(nodes4);
+		if (layout == bvh_layout::wide8)
+			return valid_wide(nodes8);
+		if (nodes.empty()) return true;
+
+		//children always follow their parent, so one pass in node order sees every parent first
+		std::vector<int> depth(nodes.size(), -1);
+		depth[0] = 0;
+		for (size_t n = 0; n < nodes.size(); n++)
 		{
-			if (comparer(objs[start], objs[start + 1])) {
-				left = objs[start];
-				right = objs[start + 1];
+			if (depth[n] < 0) continue;
+			const bvh_linear_node& node = nodes[n];
+			if (node.is_leaf())
+			{
+				if ((uint64_t)node.left_first + node.count > indices.size()) return false;
+				continue;
 			}
-			else
+			if (node.left_first <= n || (size_t)node.left_first + 1 >= nodes.size() || depth[n] + 1 >= stack_size)
+				return false;
+			depth[node.left_first] = std::max(depth[node.left_first], depth[n] + 1);
+			depth[node.left_first + 1] = std::max(depth[node.left_first + 1], depth[n] + 1);
+		}
+		return true;
+	}
+
+	size_t node_bytes() const
+	{
+		return nodes.size() * sizeof(bvh_linear_node) + nodes4.size() * sizeof(bvh_wide_node<4>) + nodes8.size() * sizeof(bvh_wide_node<8>);
+	}
+
+	// intersect(primitive, ray_t) is called for every primitive in a visited leaf and returns true on a hit,
+	// after shrinking ray_t.max to the hit distance. Children are visited nearest first.
+	template<typename F>
+	bool traverse(const ray& r, interval ray_t, F&& intersect) const
+	{
+		return traverse(traversal_ray(r), ray_t, intersect);
+	}
+
+	template<typename F>
+	bool traverse(const traversal_ray& r, interval ray_t, F&& intersect) const
+	{
+		return search<false>(r, ray_t, intersect);
+	}
+
+	// Any-hit query for shadow rays: returns true as soon as intersect reports a hit on any primitive,
+	// which need not be the closest one.
+	template<typename F>
+	bool occluded(const traversal_ray& r, interval ray_t, F&& intersect) const
+	{
+		return search<true>(r, ray_t, intersect);
+	}
+
+	// Packet version of traverse: intersect(primitive, mask) tests the lanes in mask against a primitive
+	// and returns the lanes it hit, after shrinking their packet tmax. Every node is fetched once
+	// for the whole packet and visited while any lane still reaches it.
+	template<typename F>
+	int traverse_packet(ray_packet& packet, int mask, F&& intersect) const
+	{
+		if (layout == bvh_layout::wide4)
+			return traverse_packet_wide(nodes4, packet, mask, intersect);
+		if (layout == bvh_layout::wide8)
+			return traverse_packet_wide(nodes8, packet, mask, intersect);
+		if (nodes.empty()) return 0;
+
+		struct entry { uint32_t node; int mask; float dist; };
+		entry stack[stack_size];
+		int stack_ptr = 0;
+		int hits = 0;
+
+		float dist;
+		mask = packet.intersect_box(nodes[0].bmin, nodes[0].bmax, mask, dist);
+		if (mask)
+			stack[stack_ptr++] = { 0, mask, dist };
+
+		while (stack_ptr > 0)
+		{
+			entry current = stack[--stack_ptr];
+			current.mask = packet.reaching(current.mask, current.dist);
+			if (!current.mask) continue;
+
+			const bvh_linear_node& node = nodes[current.node];
+			if (node.is_leaf())
 			{
-				left = objs[start + 1];
-				right = objs[start];
+				for (uint32_t i = 0; i < node.count; i++)
+				{
+					hits |= intersect(indices[node.left_first + i], current.mask);
+				}
+				continue;
 			}
+
+			entry near_child = { node.left_first, 0, 0 };
+			entry far_child = { node.left_first + 1, 0, 0 };
+			near_child.mask = packet.intersect_box(nodes[near_child.node].bmin, nodes[near_child.node].bmax, current.mask, near_child.dist);
+			far_child.mask = packet.intersect_box(nodes[far_child.node].bmin, nodes[far_child.node].bmax, current.mask, far_child.dist);
+			if (far_child.mask && (!near_child.mask || far_child.dist < near_child.dist))
+				std::swap(near_child, far_child);
+
+			if (far_child.mask)
+				stack[stack_ptr++] = far_child;
+			if (near_child.mask)
+				stack[stack_ptr++] = near_child;
 		}
-		else
-		{	
+		return hits;
+	}
+
+private:
+	aabb root_bounds;
+
+	template<int N, typename F>
+	int traverse_packet_wide(const std::vector<bvh_wide_node<N>>& wide, ray_packet& packet, int mask, F& intersect) const
+	{
+		if (wide.empty()) return 0;
+
+		struct entry { uint32_t node; uint32_t count; int mask; float dist; };
+		entry stack[stack_size * (N - 1) + 1];
+		int stack_ptr = 0;
+		stack[stack_ptr++] = { 0, 0, mask, packet.tmin_f };
+		int hits = 0;
 
-			std::sort(objs.begin() , objs.end(), comparer);
-			
-			
+		while (stack_ptr > 0)
+		{
+			entry current = stack[--stack_ptr];
+			current.mask = packet.reaching(current.mask, current.dist);
+			if (!current.mask) continue;
+
+			if (current.count > 0)
+			{
+				for (uint32_t i = 0; i < current.count; i++)
+				{
+					hits |= intersect(indices[current.node + i], current.mask);
+				}
+				continue;
+			}
 
-			auto mid = start + (object_length / 2);
-			
-			
-			if (*count < 6)
+			const auto& node = wide[current.node];
+			entry children[N];
+			int child_count = 0;
+			for (int c = 0; c < N; c++)
+			{
+				if (node.bmin[0][c] > node.bmax[0][c]) continue; //empty slot
+
+				float bmin[3] = { node.bmin[0][c], node.bmin[1][c], node.bmin[2][c] };
+				float bmax[3] = { node.bmax[0][c], node.bmax[1][c], node.bmax[2][c] };
+				entry e = { node.child[c], node.count[c], 0, 0 };
+				e.mask = packet.intersect_box(bmin, bmax, current.mask, e.dist);
+				if (!e.mask) continue;
+
+				//sorted far to near, the nearest child ends up on top of the stack
+				int k = child_count++;
+				while (k > 0 && children[k - 1].dist < e.dist)
+				{
+					children[k] = children[k - 1];
+					k--;
+				}
+				children[k] = e;
+			}
+			for (int k = 0; k < child_count; k++)
 			{
-				*count++;
-				shared_ptr<hittable>* leftptr = &left;
-				shared_ptr<hittable>* rightptr = &right;
-				std::vector<shared_ptr<hittable>>* objsptr = &objs;
+				stack[stack_ptr++] = children[k];
+			}
+		}
+		return hits;
+	}
+
+	template<bool any_hit, typename F>
+	bool search(const traversal_ray& r, interval ray_t, F& intersect) const
+	{
+		if (layout == bvh_layout::wide4)
+			return traverse_wide<any_hit>(nodes4, r, ray_t, intersect);
+		if (layout == bvh_layout::wide8)
+			return traverse_wide<any_hit>(nodes8, r, ray_t, intersect);
+		if (nodes.empty()) return false;
 
-				auto lthread = std::thread([&, start, mid] {
-					*leftptr = make_shared<bvh_node>(*objsptr, start, mid, count);
-					});
-				auto rthread = std::thread([&, end, mid] {
-					*rightptr = make_shared<bvh_node>(*objsptr, mid, end, count);
-					});
+		const float tmin = -float_above(-ray_t.min);
+		float tmax = float_above(ray_t.max);
+		if (intersect_node(nodes[0], r, tmin, tmax) == infinity)
+			return false;
+
+		struct entry { uint32_t node; float dist; };
+		entry stack[stack_size];
+		int stack_ptr = 0;
+		bool hit_anything = false;
 
-				lthread.join();
-				rthread.join();
+		const bvh_linear_node* node = &nodes[0];
+		while (true)
+		{
+			if (node->is_leaf())
+			{
+				for (uint32_t i = 0; i < node->count; i++)
+				{
+					if (intersect(indices[node->left_first + i], ray_t))
+					{
+						if (any_hit) return true;
+						hit_anything = true;
+						tmax = float_above(ray_t.max);
+					}
+				}
 			}
 			else
 			{
+				uint32_t near_index = node->left_first;
+				uint32_t far_index = node->left_first + 1;
+				float near_dist = intersect_node(nodes[near_index], r, tmin, tmax);
+				float far_dist = intersect_node(nodes[far_index], r, tmin, tmax);
+				if (far_dist < near_dist)
+				{
+					std::swap(near_index, far_index);
+					std::swap(near_dist, far_dist);
+				}
 
-				left = (make_shared<bvh_node>(objs, start, mid,count));
-				right = (make_shared<bvh_node>(objs, mid, end,count));
+				if (near_dist != infinity)
+				{
+					if (far_dist != infinity)
+						stack[stack_ptr++] = { far_index, far_dist };
+					node = &nodes[near_index];
+					continue;
+				}
 			}
+
+			//pop the next node that is still in front of the closest hit
+			node = nullptr;
+			while (stack_ptr > 0)
+			{
+				auto& next = stack[--stack_ptr];
+				if (next.dist <= tmax)
+				{
+					node = &nodes[next.node];
+					break;
+				}
+			}
+			if (!node) break;
 		}
-		bbox = aabb(left->bounding_box(), right->bounding_box());		
+		return hit_anything;
 	}
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-		if (!bbox.hit(r, ray_t))
-			return false;
+	template<bool any_hit, int N, typename F>
+	bool traverse_wide(const std::vector<bvh_wide_node<N>>& wide, const traversal_ray& r, interval& ray_t, F& intersect) const
+	{
+		if (wide.empty()) return false;
 
-		bool hit_left = left->hit(r, ray_t, rec);
-		bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+		const float tmin = -float_above(-ray_t.min);
+		float tmax = float_above(ray_t.max);
 
-		return hit_left || hit_right;
+		struct entry { uint32_t node; uint32_t count; float dist; };
+		entry stack[stack_size * (N - 1) + 1];
+		int stack_ptr = 0;
+		entry current = { 0, 0, tmin };
+		bool hit_anything = false;
+
+		while (true)
+		{
+			if (current.count > 0)
+			{
+				for (uint32_t i = 0; i < current.count; i++)
+				{
+					if (intersect(indices[current.node + i], ray_t))
+					{
+						if (any_hit) return true;
+						hit_anything = true;
+						tmax = float_above(ray_t.max);
+					}
+				}
+			}
+			else
+			{
+				const auto& node = wide[current.node];
+				alignas(32) float dist[N];
+				int mask = N == 8
+					? r.intersect_box8(node.bmin[0], node.bmax[0], N, tmin, tmax, dist)
+					: r.intersect_box4(node.bmin[0], node.bmax[0], N, tmin, tmax, dist);
+
+				if (mask)
+				{
+					//the nearest child is visited next, the others are pushed far to near
+					entry hits[N];
+					int hit_count = 0;
+					for (; mask; mask &= mask - 1)
+					{
+						int c = ctz(mask);
+						entry e = { node.child[c], node.count[c], dist[c] };
+						int k = hit_count++;
+						while (k > 0 && hits[k - 1].dist < e.dist)
+						{
+							hits[k] = hits[k - 1];
+							k--;
+						}
+						hits[k] = e;
+					}
+					for (int k = 0; k < hit_count - 1; k++)
+					{
+						stack[stack_ptr++] = hits[k];
+					}
+					current = hits[hit_count - 1];
+					continue;
+				}
+			}
+
+			//pop the next node that is still in front of the closest hit
+			bool found = false;
+			while (stack_ptr > 0)
+			{
+				current = stack[--stack_ptr];
+				if (current.dist <= tmax)
+				{
+					found = true;
+					break;
+				}
+			}
+			if (!found) break;
+		}
+		return hit_anything;
 	}
 
-	aabb bounding_box() const override {
-		return bbox;
+	static int ctz(int mask)
+	{
+		int index = 0;
+		while (!(mask & 1))
+		{
+			mask >>= 1;
+			index++;
+		}
+		return index;
 	}
 
-private:
-	shared_ptr<hittable> left,right;
-	aabb bbox;
+	static aabb bounds_of(const bvh_linear_node& n)
+	{
+		return aabb(interval(n.bmin[0], n.bmax[0]), interval(n.bmin[1], n.bmax[1]), interval(n.bmin[2], n.bmax[2]));
+	}
 
-	static bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index) {
-		return a->bounding_box().axis(axis_index).min < b->bounding_box().axis(axis_index).min;
+	static float half_area(const bvh_linear_node& n)
+	{
+		float ex = n.bmax[0] - n.bmin[0], ey = n.bmax[1] - n.bmin[1], ez = n.bmax[2] - n.bmin[2];
+		return ex * ey + ey * ez + ez * ex;
 	}
 
-	static bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-		return box_compare(a, b, 0);
+	template<int N>
+	bool valid_wide(const std::vector<bvh_wide_node<N>>& wide) const
+	{
+		std::vector<int> depth(wide.size(), -1);
+		if (!wide.empty()) depth[0] = 0;
+		for (size_t n = 0; n < wide.size(); n++)
+		{
+			if (depth[n] < 0) continue;
+			for (int c = 0; c < N; c++)
+			{
+				if (wide[n].count[c] > 0)
+				{
+					if ((uint64_t)wide[n].child[c] + wide[n].count[c] > indices.size()) return false;
+				}
+				else if (!(wide[n].bmin[0][c] > wide[n].bmax[0][c])) //empty slots are never entered, anything else might be
+				{
+					const uint32_t child = wide[n].child[c];
+					if (child <= n || child >= wide.size() || depth[n] + 1 >= stack_size)
+						return false;
+					depth[child] = std::max(depth[child], depth[n] + 1);
+				}
+			}
+		}
+		return true;
 	}
 
-	static bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-		return box_compare(a, b, 1);
+	// Turns the binary subtree at node into a wide node: the children are opened up largest first
+	// until N slots are filled or only leaves are left.
+	template<int N>
+	uint32_t collapse(uint32_t node, std::vector<bvh_wide_node<N>>& wide) const
+	{
+		uint32_t slots[N];
+		int slot_count = 0;
+		if (nodes[node].is_leaf())
+		{
+			slots[slot_count++] = node;
+		}
+		else
+		{
+			slots[slot_count++] = nodes[node].left_first;
+			slots[slot_count++] = nodes[node].left_first + 1;
+		}
+
+		while (slot_count < N)
+		{
+			int largest = -1;
+			float largest_area = -1;
+			for (int i = 0; i < slot_count; i++)
+			{
+				if (!nodes[slots[i]].is_leaf() && half_area(nodes[slots[i]]) > largest_area)
+				{
+					largest = i;
+					largest_area = half_area(nodes[slots[i]]);
+				}
+			}
+			if (largest < 0) break;
+
+			uint32_t opened = slots[largest];
+			slots[largest] = nodes[opened].left_first;
+			slots[slot_count++] = nodes[opened].left_first + 1;
+		}
+
+		uint32_t index = (uint32_t)wide.size();
+		wide.emplace_back();
+		for (int i = 0; i < N; i++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				wide[index].bmin[a][i] = std::numeric_limits<float>::infinity();
+				wide[index].bmax[a][i] = -std::numeric_limits<float>::infinity();
+			}
+			wide[index].child[i] = 0;
+			wide[index].count[i] = 0;
+		}
+
+		for (int i = 0; i < slot_count; i++)
+		{
+			const auto& child = nodes[slots[i]];
+			for (int a = 0; a < 3; a++)
+			{
+				wide[index].bmin[a][i] = child.bmin[a];
+				wide[index].bmax[a][i] = child.bmax[a];
+			}
+			if (child.is_leaf())
+			{
+				wide[index].child[i] = child.left_first;
+				wide[index].count[i] = child.count;
+			}
+			else
+			{
+				//the vector may grow while the subtree is collapsed, so the slot is written through its index
+				uint32_t child_index = collapse(slots[i], wide);
+				wide[index].child[i] = child_index;
+			}
+		}
+		return index;
 	}
 
-	static bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-		return box_compare(a, b, 2);
+	struct prim_box {
+		float bmin[3], bmax[3], centroid[3];
+
+		prim_box() {};
+		prim_box(const aabb& box)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				//round outwards so the float box always contains the double one
+				bmin[a] = std::nextafter((float)box.axis(a).min, -std::numeric_limits<float>::infinity());
+				bmax[a] = std::nextafter((float)box.axis(a).max, std::numeric_limits<float>::infinity());
+				centroid[a] = 0.5f * (bmin[a] + bmax[a]);
+			}
+		}
+	};
+
+	struct bin {
+		float bmin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float bmax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		uint32_t count = 0;
+
+		void grow(const float* lo, const float* hi)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				bmin[a] = std::min(bmin[a], lo[a]);
+				bmax[a] = std::max(bmax[a], hi[a]);
+			}
+		}
+
+		float area() const
+		{
+			float ex = bmax[0] - bmin[0], ey = bmax[1] - bmin[1], ez = bmax[2] - bmin[2];
+			return ex * ey + ey * ez + ez * ex;
+		}
+	};
+
+	struct bin_set {
+		bin bins[3][bin_count];
+	};
+
+	struct split_plane {
+		int axis = -1;
+		int index = 0; //last bin that goes to the left child
+		float cost = FLT_MAX;
+		float cmin = 0, cmax = 0;
+		bin left, right;
+	};
+
+	std::vector<prim_box> prims;
+	std::atomic<uint32_t> used_nodes{ 0 };
+
+	static float intersect_node(const bvh_linear_node& n, const traversal_ray& r, float tmin, float tmax)
+	{
+		return r.intersect_box(n.bmin, n.bmax, tmin, tmax);
+	}
+
+	// Runs fn(first, last) over [0, count), split into chunks on the pool when it is worth it.
+	template<typename F>
+	static void parallel_chunks(thread_pool* pool, uint32_t count, F&& fn)
+	{
+		if (!pool || count < parallel_binning_size)
+		{
+			fn(0u, count);
+			return;
+		}
+		task_group chunks(*pool);
+		for (uint32_t first = 0; first < count; first += chunk_size)
+		{
+			uint32_t last = std::min(count, first + chunk_size);
+			chunks.run([&fn, first, last] { fn(first, last); });
+		}
+		chunks.wait();
+	}
+
+	void update_bounds(uint32_t node_index)
+	{
+		auto& node = nodes[node_index];
+		bin box;
+		for (uint32_t i = 0; i < node.count; i++)
+		{
+			auto& prim = prims[indices[node.left_first + i]];
+			box.grow(prim.bmin, prim.bmax);
+		}
+		set_bounds(node, box);
+	}
+
+	static void set_bounds(bvh_linear_node& node, const bin& box)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			node.bmin[a] = box.bmin[a];
+			node.bmax[a] = box.bmax[a];
+		}
+	}
+
+	void centroid_bounds(uint32_t first, uint32_t last, bin& out) const
+	{
+		for (uint32_t i = first; i < last; i++)
+		{
+			auto& centroid = prims[indices[i]].centroid;
+			out.grow(centroid, centroid);
+		}
+	}
+
+	void fill_bins(uint32_t first, uint32_t last, const bin& centroids, const float* scale, bin_set& out) const
+	{
+		for (uint32_t i = first; i < last; i++)
+		{
+			auto& prim = prims[indices[i]];
+			for (int a = 0; a < 3; a++)
+			{
+				if (scale[a] <= 0) continue;
+				int b = std::min(bin_count - 1, (int)((prim.centroid[a] - centroids.bmin[a]) * scale[a]));
+				out.bins[a][b].count++;
+				out.bins[a][b].grow(prim.bmin, prim.bmax);
+			}
+		}
+	}
+
+	split_plane find_split(const bvh_linear_node& node, thread_pool* pool) const
+	{
+		const uint32_t first = node.left_first;
+		const bool parallel = pool && node.count >= parallel_binning_size;
+		const uint32_t chunk_count = parallel ? (node.count + chunk_size - 1) / chunk_size : 1;
+
+		//centroid bounds, then one binning pass for all three axes, per chunk when the node is large
+		std::vector<bin> chunk_centroids(chunk_count);
+		parallel_chunks(parallel ? pool : nullptr, node.count, [&](uint32_t lo, uint32_t hi) {
+			centroid_bounds(first + lo, first + hi, chunk_centroids[lo / chunk_size]);
+		});
+		bin centroids;
+		for (auto& c : chunk_centroids)
+		{
+			centroids.grow(c.bmin, c.bmax);
+		}
+
+		float scale[3];
+		for (int a = 0; a < 3; a++)
+		{
+			float extent = centroids.bmax[a] - centroids.bmin[a];
+			scale[a] = extent > 0 ? bin_count / extent : 0;
+		}
+
+		std::vector<bin_set> chunk_bins(chunk_count);
+		parallel_chunks(parallel ? pool : nullptr, node.count, [&](uint32_t lo, uint32_t hi) {
+			fill_bins(first + lo, first + hi, centroids, scale, chunk_bins[lo / chunk_size]);
+		});
+		bin_set& bins = chunk_bins[0];
+		for (uint32_t c = 1; c < chunk_count; c++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				for (int b = 0; b < bin_count; b++)
+				{
+					bins.bins[a][b].count += chunk_bins[c].bins[a][b].count;
+					bins.bins[a][b].grow(chunk_bins[c].bins[a][b].bmin, chunk_bins[c].bins[a][b].bmax);
+				}
+			}
+		}
+
+		split_plane best;
+		for (int a = 0; a < 3; a++)
+		{
+			if (scale[a] <= 0) continue;
+			auto& axis_bins = bins.bins[a];
+
+			//sweep from both sides to get the cost of splitting after each bin
+			bin left_box[bin_count - 1], right_box[bin_count - 1];
+			uint32_t left_count[bin_count - 1], right_count[bin_count - 1];
+			bin left, right;
+			uint32_t left_sum = 0, right_sum = 0;
+			for (int i = 0; i < bin_count - 1; i++)
+			{
+				left_sum += axis_bins[i].count;
+				left_count[i] = left_sum;
+				left.grow(axis_bins[i].bmin, axis_bins[i].bmax);
+				left_box[i] = left;
+
+				right_sum += axis_bins[bin_count - 1 - i].count;
+				right_count[bin_count - 2 - i] = right_sum;
+				right.grow(axis_bins[bin_count - 1 - i].bmin, axis_bins[bin_count - 1 - i].bmax);
+				right_box[bin_count - 2 - i] = right;
+			}
+
+			for (int i = 0; i < bin_count - 1; i++)
+			{
+				if (left_count[i] == 0 || right_count[i] == 0) continue;
+				float cost = left_count[i] * left_box[i].area() + right_count[i] * right_box[i].area();
+				if (cost < best.cost)
+				{
+					best.cost = cost;
+					best.axis = a;
+					best.index = i;
+					best.cmin = centroids.bmin[a];
+					best.cmax = centroids.bmax[a];
+					best.left = left_box[i];
+					best.right = right_box[i];
+				}
+			}
+		}
+
+		return best;
+	}
+
+	void subdivide(uint32_t node_index, int depth, thread_pool* pool)
+	{
+		auto& node = nodes[node_index];
+		if (node.count <= 2 || depth >= max_depth) return;
+
+		auto split = find_split(node, pool);
+		if (split.axis < 0) return;
+
+		bin parent;
+		parent.grow(node.bmin, node.bmax);
+		if (split.cost >= node.count * parent.area()) return;
+
+		//partition primitives around the chosen bin boundary
+		int axis = split.axis;
+		float scale = bin_count / (split.cmax - split.cmin);
+		uint32_t* first = indices.data() + node.left_first;
+		uint32_t* last = first + node.count;
+		uint32_t* mid = std::partition(first, last, [&](uint32_t index) {
+			int b = std::min(bin_count - 1, (int)((prims[index].centroid[axis] - split.cmin) * scale));
+			return b <= split.index;
+		});
+
+		uint32_t left_count = (uint32_t)(mid - first);
+		if (left_count == 0 || left_count == node.count) return;
+
+		uint32_t left_index = used_nodes.fetch_add(2);
+
+		auto& left = nodes[left_index];
+		auto& right = nodes[left_index + 1];
+		left.left_first = node.left_first;
+		left.count = left_count;
+		right.left_first = node.left_first + left_count;
+		right.count = node.count - left_count;
+		node.left_first = left_index;
+		node.count = 0;
+
+		//the bins already hold the exact child bounds
+		set_bounds(left, split.left);
+		set_bounds(right, split.right);
+
+		if (pool && left.count >= parallel_subtree_size && right.count >= parallel_subtree_size)
+		{
+			task_group subtrees(*pool);
+			subtrees.run([this, left_index, depth, pool] { subdivide(left_index, depth + 1, pool); });
+			subdivide(left_index + 1, depth + 1, pool);
+			subtrees.wait();
+		}
+		else
+		{
+			subdivide(left_index, depth + 1, pool);
+			subdivide(left_index + 1, depth + 1, pool);
+		}
 	}
 };
 
+class bvh_node : public hittable {
+public:
+	bvh_node(const hittable_list& list, thread_pool* pool = nullptr) {
+		std::vector<aabb> bounds;
+		bounds.reserve(list.objects.size());
+		for (const auto& object : list.objects)
+		{
+			bounds.push_back(object->bounding_box());
+		}
+		tree.build(bounds, pool);
+
+		//store the objects in leaf order so a leaf walks a contiguous range
+		objects.reserve(tree.indices.size());
+		for (auto index : tree.indices)
+		{
+			objects.push_back(list.objects[index]);
+		}
+		for (size_t i = 0; i < tree.indices.size(); i++)
+		{
+			tree.indices[i] = (uint32_t)i;
+		}
+		bbox = tree.bounding_box();
+	};
+
+	bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+		return tree.traverse(r, ray_t, [&](uint32_t index, interval& t) {
+			if (!objects[index]->intersect(r, t, rec))
+				return false;
+			t.max = rec.t;
+			return true;
+		});
+	}
+
+	bool occluded(const ray& r, interval ray_t) const override {
+		return tree.occluded(traversal_ray(r), ray_t, [&](uint32_t index, interval& t) {
+			return objects[index]->occluded(r, t);
+		});
+	}
+
+	int hit_packet(ray_packet& packet, int mask, hit_record* recs) const override {
+		return tree.traverse_packet(packet, mask, [&](uint32_t index, int lanes) {
+			return objects[index]->hit_packet(packet, lanes, recs);
+		});
+	}
+
+	aabb bounding_box() const override {
+		return bbox;
+	}
 
+	double build_time() const {
+		return tree.build_seconds;
+	}
 
+	void collect_lights(std::vector<const hittable*>& lights) const override {
+		for (const auto& object : objects)
+		{
+			object->collect_lights(lights);
+		}
+	}
+
+private:
+	bvh_tree tree;
+	vector<shared_ptr<hittable>> objects;
+	aabb bbox;
+};
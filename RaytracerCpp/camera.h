@@ -2,8 +2,52 @@
 #include "general.h"
 #include "material.h"
 #include "hittable.h"
+#include "threadpool.h"
+#include "framebuffer.h"
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+
+// Ray counts of the renders since the last reset, shared by every copy of the camera.
+struct render_stats {
+	std::atomic<uint64_t> primary_rays{ 0 };
+	std::atomic<uint64_t> total_rays{ 0 }; //every ray cast into the world, bounces and shadow rays included
+
+	void reset() {
+		primary_rays = 0;
+		total_rays = 0;
+	}
+
+	void add(uint64_t primary, uint64_t total) {
+		primary_rays.fetch_add(primary, std::memory_order_relaxed);
+		total_rays.fetch_add(total, std::memory_order_relaxed);
+	}
+};
+
+// What a camera ray found first, written to the framebuffer next to the color.
+struct first_hit {
+	color albedo; //reflectance of the surface, or the background / emission where the path ends
+	vec3 normal; //world space, zero for a miss
+	double depth = infinity;
+	uint32_t object_id = 0;
+	uint32_t primitive_id = 0;
+
+	// Adds a sample to a pixel's sums, depth keeps the closest hit and ids come from the pixel's first sample.
+	void add(const first_hit& sample, bool first_sample)
+	{
+		albedo += sample.albedo;
+		normal += sample.normal;
+		depth = fmin(depth, sample.depth);
+		if (first_sample)
+		{
+			object_id = sample.object_id;
+			primitive_id = sample.primitive_id;
+		}
+	}
+};
 
 class camera {
 public:
@@ -12,10 +56,14 @@ public:
 	int image_height;
 	int samples_per_pixel = 100;
 	int max_depth = 20; //bounches
+	bool russian_roulette = true; //off traces every path to max_depth, for reference renders
+	int roulette_min_depth = 3;
+	bool light_sampling = true; //next event estimation towards emissive quads and spheres
 	int threadsize = 20;
 	int tilesize = 20;
 	bool tiledthreading = true;
-	color* pixelarray;
+	bool packet_tracing = true; //camera rays of a tile row are traced as packets of 8
+	std::vector<color> pixelarray; //mean color of each pixel's last pass
 	shared_ptr<texture> background = make_shared<solid_color>(color(0.5, 0.7, 1.0));
 
 	int vertical_fov = 90;
@@ -28,13 +76,45 @@ public:
 	double focus_dist = 10;
 
 	int seedMultiplier = 97531;
+	int samples_per_pass = 1; //samples added to every pixel by one render call
+
+	//tiles whose pixels all reached adaptive_threshold stop sampling, their budget goes to the noisier tiles
+	bool adaptive_sampling = false;
+	double adaptive_threshold = 0.01; //standard error of a pixel's luminance, relative to sqrt of its mean
+	int adaptive_min_samples = 16;
+	int adaptive_max_samples = 0; //per pixel limit for noisy tiles, 0 means 4x samples_per_pixel
 
 	bool multithreading = true;
 
+	//worker threads are created once and reused by every render call until threadsize changes
+	shared_ptr<thread_pool> pool;
+	shared_ptr<render_stats> stats = make_shared<render_stats>();
+
+	//called from the worker that finished a tile, or a row outside of tiled threading, with its pixels
+	//final for this render call; resolve(rect, out) is safe to call on them from there
+	std::function<void(const tile_rect&)> tile_done;
+	//when set the running render call skips the tiles it has not started, the pass is left incomplete
+	const std::atomic<bool>* cancel = nullptr;
+
 	struct t2 {int x;int y; };
 
+	// Adds samples_per_pass samples to every pixel of the accumulation buffer.
+	// Call reset_accumulation() to start a new image, e.g. after the camera or scene changed.
 	void render(const hittable& world) {	
 		initialize();
+		prepare_buffers();
+		pass_samples = std::max(1, std::min(samples_per_pass, sample_limit() - sample_count));
+		if (adaptive_sampling && sample_count > 0)
+		{
+			//spread what is left of the image's budget over the tiles that are still active
+			uint64_t budget = (uint64_t)image_width * image_height * samples_per_pixel;
+			uint64_t active = std::max<uint64_t>(active_pixels(), 1);
+			uint64_t left = budget > traced_samples ? budget - traced_samples : 0;
+			pass_samples = (int)std::max<uint64_t>(1, std::min<uint64_t>(pass_samples, (left + active - 1) / active));
+		}
+		lights.clear();
+		world.collect_lights(lights);
+		collect_changed_tiles();
 		const hittable* worldptr = &world;
 		if (multithreading)
 		{
@@ -45,15 +125,71 @@ public:
 		}
 		else
 		{
-			for (int j = 0; j < image_height; j++) {							
+			uint64_t pixels = 0, rays = 0;
+			for (int j = 0; j < image_height && !cancelled(); j++) {							
 				for (int i = 0; i < image_width; i++)
 				{
-					pixelOperation(worldptr, i, j);
+					uint64_t pixel_rays = pixelOperation(worldptr, i, j);
+					pixels += pixel_rays > 0;
+					rays += pixel_rays;
 				}
+				if (tile_done)
+					tile_done({ 0, j, image_width, 1 });
 			}
+			stats->add(pixels * pass_samples, rays);
 		}
+		sample_count += pass_samples;
+		traced_samples += active_pixels() * pass_samples;
+		if (adaptive_sampling)
+			update_convergence();
+	}
+
+	//samples taken by the pixels that are still being sampled
+	int accumulated_samples() const { return sample_count; }
+
+	void reset_accumulation() { sample_count = 0; }
+
+	// False once the image is done: every pixel reached samples_per_pixel, or with adaptive sampling
+	// every tile converged or the samples_per_pixel budget of the whole image was spent.
+	bool needs_samples() const
+	{
+		if (sample_count == 0) return true;
+		if (sample_count >= sample_limit()) return false;
+		if (!adaptive_sampling) return true;
+		return active_tiles > 0 && traced_samples < (uint64_t)image_width * image_height * samples_per_pixel;
 	}
 
+	double converged_fraction() const
+	{
+		return tile_active.empty() ? 0 : 1.0 - (double)active_tiles / tile_active.size();
+	}
+
+	// Writes the mean of each pixel's accumulated samples as rgb floats, out must hold image_width * image_height * 3.
+	// The result is linear radiance, see tonemap() for display values.
+	void resolve(float* out) const
+	{
+		frame.resolve(aov_r, 3, out);
+	}
+
+	// Same as resolve for one region, out holds rect.width * rect.height * 3 floats.
+	void resolve(const tile_rect& rect, float* out) const
+	{
+		frame.resolve(aov_r, 3, rect, out);
+	}
+
+	// Same as resolve for the first hit albedo and normal of the samples, the auxiliary images of the denoiser.
+	void resolve_first_hits(float* albedo, float* normal) const
+	{
+		frame.resolve(aov_albedo_r, 3, albedo);
+		frame.resolve(aov_normal_x, 3, normal);
+	}
+
+	//every output of the renders since reset_accumulation()
+	const framebuffer& aovs() const { return frame; }
+
+	//pixels the last render call sampled, the rest of the image kept its values
+	const std::vector<tile_rect>& changed_tiles() const { return changed; }
+
 	void multithreaded(const hittable* worldptr)
 	{		
 		vector<std::thread> threads;
@@ -95,15 +231,10 @@ public:
 
 	void tilemultithreaded(const hittable* worldptr)
 	{
-		vector<std::thread> threads;
-
 		int tilesizex = ceilf((double)image_width / tilesize);
 		int tilesizey = ceilf((double)image_height / tilesize);
 
-		std::mutex mtx;
-		std::vector<t2> blocks;
-
-
+		task_group tiles(workers());
 		for (int i = 0; i < tilesizex; i++)
 		{
 			for (int j = 0; j < tilesizey; j++)
@@ -111,40 +242,37 @@ public:
 				t2 _id;
 				_id.x = i;
 				_id.y = j;
-				blocks.push_back(_id);
+				if (adaptive_sampling && !tile_active[tile_index(i * tilesize, j * tilesize)])
+					continue;
+				tiles.run([this, worldptr, _id] { tileOperation(worldptr, _id); });
 			}
 		}
-
-		for (int i = 0; i < threadsize; i++)
-		{			
-			threads.push_back(std::thread(&camera::tileThread, *this, worldptr, std::ref(blocks), std::ref(mtx)));
-		}
-
-		for (auto& th : threads)
-		{
-			th.join();
-		}
+		tiles.wait();
 	}
 
-	void tileThread(const hittable* worldptr, std::vector<t2>& blocks, std::mutex& mtx)
-	{		
-		t2 current;
-		while (true)
+	void tileOperation(const hittable* worldptr, t2 current)
+	{
+		if (cancelled()) return;
+		uint64_t pixels = 0, rays = 0;
+		if (packet_tracing)
 		{
-			mtx.lock();
-			if (blocks.size() > 0)
+			for (int j = 0; j < tilesize; j++)
 			{
-				current = blocks.back();
-				blocks.pop_back();
-			}
-			else
-			{
-				mtx.unlock();
-				return;
+				int cy = (tilesize * current.y) + j;
+				if (cy >= image_height) break;
+				for (int i = 0; i < tilesize; i += ray_packet::size)
+				{
+					int cx = (tilesize * current.x) + i;
+					int count = std::min({ ray_packet::size, tilesize - i, image_width - cx });
+					if (count <= 0) break;
+					uint64_t packet_rays = packetOperation(worldptr, cx, cy, count);
+					pixels += packet_rays > 0 ? count : 0;
+					rays += packet_rays;
+				}
 			}
-			mtx.unlock();
-
-
+		}
+		else
+		{
 			for (int i = 0; i < tilesize;i++)
 			{
 				int cx = (tilesize * current.x) + i;
@@ -152,24 +280,39 @@ public:
 				{
 					int cy = (tilesize * current.y) + j;
 					if (cx >= image_width || cy >= image_height)continue;
-					pixelOperation(worldptr, cx, cy);
+					uint64_t pixel_rays = pixelOperation(worldptr, cx, cy);
+					pixels += pixel_rays > 0;
+					rays += pixel_rays;
 				}
 			}
 		}
+		stats->add(pixels * pass_samples, rays);
+		int x = tilesize * current.x;
+		int y = tilesize * current.y;
+		if (tile_done)
+			tile_done({ x, y, std::min(tilesize, image_width - x), std::min(tilesize, image_height - y) });
+	}
+
+	thread_pool& workers()
+	{
+		int count = threadsize < 1 ? 1 : threadsize;
+		if (!pool || pool->size() != count)
+		{
+			pool.reset();
+			pool = make_shared<thread_pool>(count);
+		}
+		return *pool;
 	}
 
 	void multithreaded1(const hittable* worldptr)
 	{		
-		vector<std::thread> threads;
+		task_group blocks(workers());
 		int _threadsize = threadsize;
 		for (int z = 0; z < _threadsize;z++)
 		{
-			threads.push_back(std::thread(&camera::blockOperation, *this, worldptr, z, _threadsize));
-		}
-		for (auto& th : threads)
-		{
-			th.join();
+			blocks.run([this, worldptr, z, _threadsize] { blockOperation(worldptr, z, _threadsize); });
 		}
+		blocks.wait();
 	}	
 
 	void blockOperation(const hittable* world, int z, int threadsize)
@@ -177,59 +320,137 @@ public:
 		int blocksize = (int)ceilf( (float)image_height / threadsize);
 		int startpoint = z * blocksize;
 		int end = fmin(startpoint + blocksize,image_height);
-		for (int j = startpoint; j < end; j++) {
+		uint64_t pixels = 0, rays = 0;
+		for (int j = startpoint; j < end && !cancelled(); j++) {
 			for (int i = 0; i < image_width; i++)
 			{
-				pixelOperation(world, i, j);
+				uint64_t pixel_rays = pixelOperation(world, i, j);
+				pixels += pixel_rays > 0;
+				rays += pixel_rays;
 			}
+			if (tile_done)
+				tile_done({ 0, j, image_width, 1 });
 		}
+		stats->add(pixels * pass_samples, rays);
 	}
 
-	void pixelOperation(const hittable* world, int i, int j)
+	//returns the number of rays cast for this pixel
+	uint64_t pixelOperation(const hittable* world, int i, int j)
 	{		
-		//srand(i * j * seedMultiplier);
+		if (adaptive_sampling && !tile_active[tile_index(i, j)])
+			return 0;
+
+		int index = (j * image_width) + i;
+		int first = samples_at(index);
 		color pixel_color = color(0, 0, 0);
-		ray r = get_ray(i, j);
-		pixel_color += ray_color(r, max_depth, *world);
-		/*for (int samplecount = 0; samplecount < samples_per_pixel; samplecount++)
+		first_hit pixel_first;
+		double square_sum = 0;
+		uint64_t rays = 0;
+		for (int s = 0; s < pass_samples; s++)
 		{
+			//seeded by the sample's position in the pixel, so the result does not depend on the pass size
+			seed_random(seedMultiplier, index, first + s);
 			ray r = get_ray(i, j);
-			pixel_color += ray_color(r, max_depth, *world);
-		}*/
-		int index = (j * image_width) + i;		
-		pixelarray[index] = write_color(pixel_color);
-		//pixelarray[index] = write_color(pixel_color, samples_per_pixel);
+			first_hit sample_first;
+			color sample = ray_color(r, max_depth, *world, rays, nullptr, false, &sample_first);
+			double lum = luminance(sample);
+			square_sum += lum * lum;
+			pixel_color += sample;
+			pixel_first.add(sample_first, s == 0);
+		}
+		store_pixel(index, pixel_color, square_sum, pixel_first);
+		return rays;
+	}
+
+	// Same as pixelOperation for count neighbouring pixels of a row, all in one tile. The camera rays
+	// of a sample are traced together as one packet, the rest of each path is traced on its own.
+	uint64_t packetOperation(const hittable* world, int i, int j, int count)
+	{
+		if (adaptive_sampling && !tile_active[tile_index(i, j)])
+			return 0;
+
+		const int first_index = (j * image_width) + i;
+		color pixel_color[ray_packet::size];
+		first_hit pixel_first[ray_packet::size];
+		double square_sum[ray_packet::size] = {};
+		uint64_t rays = 0;
+		for (int s = 0; s < pass_samples; s++)
+		{
+			ray rays_in[ray_packet::size];
+			pcg32 lane_rng[ray_packet::size];
+			for (int lane = 0; lane < count; lane++)
+			{
+				//every lane keeps the random sequence its pixel would have had in pixelOperation
+				seed_random(seedMultiplier, first_index + lane, samples_at(first_index + lane) + s);
+				rays_in[lane] = get_ray(i + lane, j);
+				lane_rng[lane] = thread_rng();
+			}
+
+			ray_packet packet(rays_in, count, 0.001, infinity);
+			hit_record recs[ray_packet::size];
+			int hits = world->hit_packet(packet, packet.all(), recs);
+
+			for (int lane = 0; lane < count; lane++)
+			{
+				thread_rng() = lane_rng[lane];
+				const hit_record* primary = nullptr;
+				if ((hits >> lane) & 1)
+				{
+					recs[lane].finalize(rays_in[lane]);
+					primary = &recs[lane];
+				}
+				first_hit sample_first;
+				color sample = ray_color(rays_in[lane], max_depth, *world, rays, primary, true, &sample_first);
+				double lum = luminance(sample);
+				square_sum[lane] += lum * lum;
+				pixel_color[lane] += sample;
+				pixel_first[lane].add(sample_first, s == 0);
+			}
+		}
+		for (int lane = 0; lane < count; lane++)
+		{
+			store_pixel(first_index + lane, pixel_color[lane], square_sum[lane], pixel_first[lane]);
+		}
+		return rays;
+	}
+
+	void store_pixel(int index, const color& pixel_color, double square_sum, const first_hit& pixel_first)
+	{
+		add_sum(aov_r, index, pixel_color);
+		add_sum(aov_albedo_r, index, pixel_first.albedo);
+		add_sum(aov_normal_x, index, pixel_first.normal);
+		float& depth = frame.plane(aov_depth)[index];
+		depth = fmin(depth, (float)pixel_first.depth);
+		float& samples = frame.plane(aov_sample_count)[index];
+		if (samples == 0)
+		{
+			frame.plane(aov_object_id)[index] = (float)pixel_first.object_id;
+			frame.plane(aov_primitive_id)[index] = (float)pixel_first.primitive_id;
+		}
+		samples += pass_samples;
+		frame.plane(aov_luminance_squares)[index] += (float)square_sum;
+		pixelarray[index] = (1.0 / pass_samples) * pixel_color;
 	}
 
 	void pixelOperationThread(const hittable* world, int i, int j)
 	{		
 		color pixel_color = color(0, 0, 0);
+		uint64_t rays = 0;
 		for (int samplecount = 0; samplecount < samples_per_pixel; samplecount++)
 		{
+			seed_random(seedMultiplier, (j * image_width) + i, samplecount);
 			ray r = get_ray(i, j);
-			pixel_color += ray_color(r, max_depth, *world);
+			pixel_color += ray_color(r, max_depth, *world, rays);
 		}
+		stats->add(samples_per_pixel, rays);
 		int index = (j * image_width) + i;
-		pixelarray[index] = write_color(pixel_color, samples_per_pixel);
+		pixelarray[index] = (1.0 / samples_per_pixel) * pixel_color;
 	}
 	
 	void initialize() {
 		image_height = static_cast<int>(image_width / aspect_ratio);
 		image_height = (image_height < 1) ? 1 : image_height;
 
-		const int arraysize = image_height * image_width;
-		
-		if (!pixelarray)
-		{
-			pixelarray = (color*)malloc(arraysize * sizeof(color));
-			initsize = arraysize;
-		}if (initsize != arraysize)
-		{
-			free(pixelarray);
-			pixelarray = (color*)malloc(arraysize * sizeof(color));
-			initsize = arraysize;
-		}
-
 		center = lookfrom;
 
 		//auto focal_length = (lookfrom-lookat).length();
@@ -264,38 +485,263 @@ private:
 	vec3 pixel_delta_u,pixel_delta_v;
 	vec3 u, v, w;
 	vec3 defocus_disk_u, defocus_disk_v;
-	int initsize;
+	framebuffer frame; //sums of every sample since reset_accumulation() and the first hit outputs
+	std::vector<tile_rect> changed;
+	int sample_count = 0;
+	int pass_samples = 1;
+	uint64_t traced_samples = 0;
+
+	std::vector<uint8_t> tile_active;
+	int tiles_size = 0;
+	int tiles_x = 0;
+	int active_tiles = 0;
+
+	//adds value to the three planes starting at first
+	void add_sum(int first, int index, const vec3& value)
+	{
+		frame.plane(first)[index] += (float)value[0];
+		frame.plane(first + 1)[index] += (float)value[1];
+		frame.plane(first + 2)[index] += (float)value[2];
+	}
+
+	void collect_changed_tiles()
+	{
+		changed.clear();
+		if (!adaptive_sampling || active_tiles == (int)tile_active.size())
+		{
+			changed.push_back({ 0, 0, image_width, image_height });
+			return;
+		}
+		for (size_t t = 0; t < tile_active.size(); t++)
+		{
+			if (!tile_active[t]) continue;
+			int x = (int)(t % tiles_x) * tiles_size;
+			int y = (int)(t / tiles_x) * tiles_size;
+			changed.push_back({ x, y, std::min(tiles_size, image_width - x), std::min(tiles_size, image_height - y) });
+		}
+	}
+
+	//the accumulation buffer is only cleared for a new image, its storage is reused between images
+	void prepare_buffers()
+	{
+		if (sample_count == 0 || frame.width() != image_width || frame.height() != image_height || tiles_size != tilesize)
+		{
+			pixelarray.resize((size_t)image_width * image_height);
+			frame.resize(image_width, image_height);
+			sample_count = 0;
+			traced_samples = 0;
+
+			tiles_size = tilesize < 1 ? 1 : tilesize;
+			tilesize = tiles_size;
+			tiles_x = (image_width + tiles_size - 1) / tiles_size;
+			tile_active.assign((size_t)tiles_x * ((image_height + tiles_size - 1) / tiles_size), 1);
+			active_tiles = (int)tile_active.size();
+		}
+	}
+
+	bool cancelled() const
+	{
+		return cancel && cancel->load(std::memory_order_relaxed);
+	}
+
+	int samples_at(int index) const
+	{
+		return (int)frame.plane(aov_sample_count)[index];
+	}
+
+	int sample_limit() const
+	{
+		if (!adaptive_sampling) return samples_per_pixel;
+		return adaptive_max_samples > 0 ? adaptive_max_samples : samples_per_pixel * 4;
+	}
+
+	int tile_index(int i, int j) const
+	{
+		return (j / tiles_size) * tiles_x + (i / tiles_size);
+	}
+
+	uint64_t active_pixels() const
+	{
+		if (!adaptive_sampling) return (uint64_t)image_width * image_height;
+		uint64_t count = 0;
+		for (size_t t = 0; t < tile_active.size(); t++)
+		{
+			if (!tile_active[t]) continue;
+			int x = (int)(t % tiles_x) * tiles_size;
+			int y = (int)(t / tiles_x) * tiles_size;
+			count += (uint64_t)(std::min(x + tiles_size, image_width) - x) * (std::min(y + tiles_size, image_height) - y);
+		}
+		return count;
+	}
+
+	// Retires every tile whose noisiest pixel has a relative standard error below adaptive_threshold.
+	void update_convergence()
+	{
+		for (size_t t = 0; t < tile_active.size(); t++)
+		{
+			if (!tile_active[t]) continue;
+			int x0 = (int)(t % tiles_x) * tiles_size;
+			int y0 = (int)(t / tiles_x) * tiles_size;
+			int x1 = std::min(x0 + tiles_size, image_width);
+			int y1 = std::min(y0 + tiles_size, image_height);
+
+			double worst = 0;
+			for (int j = y0; j < y1 && worst < adaptive_threshold; j++)
+			{
+				for (int i = x0; i < x1; i++)
+				{
+					int index = (j * image_width) + i;
+					int n = samples_at(index);
+					if (n < adaptive_min_samples || n < 2)
+					{
+						worst = infinity;
+						break;
+					}
+					double mean = luminance(color(frame.plane(aov_r)[index], frame.plane(aov_g)[index], frame.plane(aov_b)[index])) / n;
+					double variance = fmax(frame.plane(aov_luminance_squares)[index] / n - mean * mean, 0.0) * n / (n - 1);
+					double error = sqrt(variance / n) / sqrt(fmax(mean, 1e-4));
+					worst = fmax(worst, error);
+				}
+			}
+
+			if (worst < adaptive_threshold)
+			{
+				tile_active[t] = 0;
+				active_tiles--;
+			}
+		}
+	}
+	std::vector<const hittable*> lights;
 
 	
 
-	color ray_color(const ray& r, int depth ,const hittable& world) const
+	// primary_traced means the first hit of r was already found by a packet, primary is then that hit or null for a miss.
+	// first, if given, receives the albedo and normal where r ended up first.
+	color ray_color(const ray& r, int depth ,const hittable& world, uint64_t& rays, const hit_record* primary = nullptr, bool primary_traced = false, first_hit* first = nullptr) const
 	{
-		hit_record rec;
+		color radiance(0, 0, 0);
+		color throughput(1, 1, 1);
+		ray current = r;
+		point3 last_p;
+		double last_scatter_pdf = 0; //0 after a specular bounce, emission is then taken at full weight
 
-		if (depth <= 0)
+		for (int bounce = 0; bounce < depth; bounce++)
 		{
-			return color(0, 0, 0);
+			hit_record rec;
+			rays++;
+			bool hit_anything;
+			if (bounce == 0 && primary_traced)
+			{
+				hit_anything = primary != nullptr;
+				if (hit_anything) rec = *primary;
+			}
+			else
+				hit_anything = world.hit(current, interval(0.001, infinity), rec);
+			if (!hit_anything)
+			{
+				color background = background_color(current);
+				if (bounce == 0 && first)
+					first->albedo = saturate(background);
+				radiance += throughput * background;
+				break;
+			}
+
+			ray scattered;
+			color attenuation;
+			color emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+			if (light_sampling && last_scatter_pdf > 0 && rec.mat->is_emissive())
+			{
+				//this light could also have been reached by the light sample at the previous bounce
+				double pdf_light = light_pdf(last_p, current.direction());
+				emission = emission * power_heuristic(last_scatter_pdf, pdf_light);
+			}
+			radiance += throughput * emission;
+
+			bool scatters = rec.mat->scatter(current, rec, attenuation, scattered);
+			if (bounce == 0 && first)
+			{
+				first->albedo = scatters ? saturate(attenuation) : saturate(emission);
+				first->normal = rec.normal;
+				first->depth = rec.t;
+				first->object_id = rec.instance ? rec.instance->id : rec.object ? rec.object->id : 0;
+				first->primitive_id = rec.primitive;
+			}
+			if (!scatters)
+				break;
+
+			last_scatter_pdf = rec.mat->scattering_pdf(current, rec, scattered);
+			last_p = rec.p;
+			if (light_sampling && last_scatter_pdf > 0)
+			{
+				radiance += throughput * sample_lights(current, rec, attenuation, world, rays);
+			}
+
+			throughput = throughput * attenuation;
+
+			//paths that can barely contribute anymore are stopped at random, survivors are scaled up to stay unbiased
+			if (russian_roulette && bounce >= roulette_min_depth)
+			{
+				double survive = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+				if (random_double() >= survive)
+					break;
+				throughput /= survive;
+			}
+			current = scattered;
 		}
+		return radiance;
+	}
 
-		if (!world.hit(r, interval(0.001, infinity), rec))		
-			return background_color(r);		
+	static color saturate(const color& c)
+	{
+		return color(fmin(fmax(c.x(), 0.0), 1.0), fmin(fmax(c.y(), 0.0), 1.0), fmin(fmax(c.z(), 0.0), 1.0));
+	}
 
-		ray scattered;
-		color attenuation;
-		color color_from_emission = rec.mat->emitted(rec.u,rec.v,rec.p);
-		if (!rec.mat->scatter(r, rec, attenuation, scattered))
+	static double power_heuristic(double pdf_a, double pdf_b)
+	{
+		double a = pdf_a * pdf_a;
+		double b = pdf_b * pdf_b;
+		return a + b > 0 ? a / (a + b) : 0;
+	}
+
+	//density of picking a direction by choosing one of the lights uniformly and sampling it
+	double light_pdf(const point3& origin, const vec3& direction) const
+	{
+		if (lights.empty()) return 0;
+		double sum = 0;
+		for (auto light : lights)
 		{
-			return color_from_emission;
+			sum += light->pdf_value(origin, direction);
 		}
-		color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
-		return color_from_scatter + color_from_emission;
-		
-		/*vec3 unit_dir = r.direction();
-		auto a = 0.5 * (unit_dir.y() + 1.0);
-		return ((1.0 - a) * color(1.0, 1.0, 1.0)) + (a * color(0.5, 0.7, 1.0));*/
+		return sum / lights.size();
+	}
+
+	// Next event estimation: one shadow ray towards a random point on a random light, MIS weighted against
+	// the chance that the diffuse bounce would have found the same light.
+	color sample_lights(const ray& r_in, const hit_record& rec, const color& albedo, const hittable& world, uint64_t& rays) const
+	{
+		if (lights.empty()) return color(0, 0, 0);
+
+		auto light = lights[random_int(0, (int)lights.size() - 1)];
+		ray shadow(rec.p, light->random(rec.p));
+
+		hit_record light_rec;
+		if (!light->hit(shadow, interval(0.001, infinity), light_rec))
+			return color(0, 0, 0);
+
+		rays++;
+		if (world.occluded(shadow, interval(0.001, light_rec.t * (1 - 1e-6))))
+			return color(0, 0, 0);
+
+		double pdf_light = light_pdf(rec.p, shadow.direction());
+		double pdf_scatter = rec.mat->scattering_pdf(r_in, rec, shadow);
+		if (pdf_light <= 0 || pdf_scatter <= 0)
+			return color(0, 0, 0);
+
+		color emission = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+		return albedo * emission * (pdf_scatter * power_heuristic(pdf_light, pdf_scatter) / pdf_light);
 	}
 
-	const color& background_color(const ray& r) const
+	color background_color(const ray& r) const
 	{
 		auto dir = r.direction();
 		auto theta = acos(-dir.y());
@@ -9,6 +9,11 @@ inline double linear_to_gamma(double _value)
 	return sqrt(_value);
 }
 
+inline double luminance(const color& c)
+{
+	return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 void write_color(std::ostream& out, color color_value, int samples_per_pixel)
 {
 	auto r = color_value.x();
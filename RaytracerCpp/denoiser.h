@@ -0,0 +1,80 @@
+#pragma once
+
+#include "external/OpenImageDenoise/oidn.hpp"
+#include <iostream>
+
+// OpenImageDenoise "RT" filter that stays committed between calls. The device is created once, the buffers
+// and the filter again only when the image size or the inputs change, so a denoise is the uploads and the
+// filter execution. Albedo and normal of the first hits guide the filter to keep edges and textures sharp.
+class denoiser {
+public:
+	bool hdr = true; //color is linear radiance, false for display values in [0,1]
+	bool srgb = false; //ldr color is gamma encoded
+
+	// color, albedo and normal are rgb floats of width * height pixels, the denoised color is written to output.
+	// albedo and normal may be null to filter the color alone.
+	bool run(const float* color, const float* albedo, const float* normal, float* output, int width, int height)
+	{
+		if (!device)
+		{
+			device = oidn::newDevice(); // CPU or GPU if available
+			device.commit();
+		}
+
+		const bool aux = albedo && normal;
+		if (!filter || width != filter_width || height != filter_height || aux != filter_aux || hdr != filter_hdr || srgb != filter_srgb)
+			build(width, height, aux);
+
+		const size_t bytes = (size_t)width * height * 3 * sizeof(float);
+		color_buffer.write(0, bytes, color);
+		if (aux)
+		{
+			albedo_buffer.write(0, bytes, albedo);
+			normal_buffer.write(0, bytes, normal);
+		}
+		filter.execute();
+
+		const char* errorMessage;
+		if (device.getError(errorMessage) != oidn::Error::None)
+		{
+			std::cout << "Error: " << errorMessage << std::endl;
+			filter = oidn::FilterRef();
+			return false;
+		}
+		color_buffer.read(0, bytes, output);
+		return true;
+	}
+
+private:
+	oidn::DeviceRef device;
+	oidn::FilterRef filter;
+	oidn::BufferRef color_buffer, albedo_buffer, normal_buffer;
+	int filter_width = 0, filter_height = 0;
+	bool filter_aux = false, filter_hdr = false, filter_srgb = false;
+
+	void build(int width, int height, bool aux)
+	{
+		const size_t bytes = (size_t)width * height * 3 * sizeof(float);
+		color_buffer = device.newBuffer(bytes);
+		albedo_buffer = aux ? device.newBuffer(bytes) : oidn::BufferRef();
+		normal_buffer = aux ? device.newBuffer(bytes) : oidn::BufferRef();
+
+		filter = device.newFilter("RT"); // generic ray tracing filter
+		filter.setImage("color", color_buffer, oidn::Format::Float3, width, height); // beauty
+		if (aux)
+		{
+			filter.setImage("albedo", albedo_buffer, oidn::Format::Float3, width, height);
+			filter.setImage("normal", normal_buffer, oidn::Format::Float3, width, height);
+		}
+		filter.setImage("output", color_buffer, oidn::Format::Float3, width, height); // denoised in place
+		filter.set("hdr", hdr);
+		filter.set("srgb", !hdr && srgb);
+		filter.commit();
+
+		filter_width = width;
+		filter_height = height;
+		filter_aux = aux;
+		filter_hdr = hdr;
+		filter_srgb = srgb;
+	}
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Channels of the framebuffer. Color, albedo and normal hold sums over the samples and are divided by
+// the sample count when resolved, the other channels are stored as they are.
+enum aov_channel : int {
+	aov_r, aov_g, aov_b,
+	aov_albedo_r, aov_albedo_g, aov_albedo_b, //of the first hit
+	aov_normal_x, aov_normal_y, aov_normal_z, //world space, of the first hit
+	aov_depth, //closest first hit distance along the camera ray over all samples, infinity for a miss
+	aov_object_id, //hittable::id hit by the pixel's first sample, 0 for a miss
+	aov_primitive_id, //e.g. the triangle of a mesh hit by the first sample
+	aov_sample_count,
+	aov_luminance_squares, //sum of squared sample luminances, for the variance estimate of adaptive sampling
+	aov_channel_count
+};
+
+// Rectangle of pixels, e.g. a render tile.
+struct tile_rect {
+	int x, y, width, height;
+};
+
+// Arbitrary output variables of a render, one plane of floats per channel. Planes keep every channel in
+// contiguous memory, so post processing runs over plain float arrays and channels are written to files as is.
+// Ids are exact up to 2^24.
+class framebuffer {
+public:
+	static const char* channel_name(int channel)
+	{
+		static const char* names[aov_channel_count] = {
+			"R", "G", "B",
+			"albedo.R", "albedo.G", "albedo.B",
+			"normal.X", "normal.Y", "normal.Z",
+			"Z", "object_id", "primitive_id", "sample_count", "luminance_squares"
+		};
+		return channel >= 0 && channel < aov_channel_count ? names[channel] : "";
+	}
+
+	//-1 if there is no channel of that name
+	static int find_channel(const std::string& name)
+	{
+		for (int c = 0; c < aov_channel_count; c++)
+		{
+			if (name == channel_name(c)) return c;
+		}
+		return -1;
+	}
+
+	int width() const { return plane_width; }
+	int height() const { return plane_height; }
+	size_t pixel_count() const { return (size_t)plane_width * plane_height; }
+
+	float* plane(int channel) { return planes[channel].data(); }
+	const float* plane(int channel) const { return planes[channel].data(); }
+
+	// Allocates the planes for a new size and clears them, keeps the storage if the size is unchanged.
+	void resize(int width, int height)
+	{
+		plane_width = width;
+		plane_height = height;
+		clear();
+	}
+
+	void clear()
+	{
+		for (int c = 0; c < aov_channel_count; c++)
+		{
+			const float value = c == aov_depth ? std::numeric_limits<float>::infinity() : 0.0f;
+			planes[c].assign(pixel_count(), value);
+		}
+	}
+
+	// Writes count channels starting at first interleaved per pixel, out must hold pixel_count() * count floats.
+	// With mean the sums are divided by the pixel's sample count, pixels without samples resolve to 0.
+	void resolve(int first, int count, float* out, bool mean = true) const
+	{
+		resolve(first, count, { 0, 0, plane_width, plane_height }, out, mean);
+	}
+
+	// Same for the pixels of rect, out must hold rect.width * rect.height * count floats.
+	void resolve(int first, int count, const tile_rect& rect, float* out, bool mean = true) const
+	{
+		for (int y = 0; y < rect.height; y++)
+		{
+			const size_t row = (size_t)(rect.y + y) * plane_width + rect.x;
+			const float* samples = plane(aov_sample_count) + row;
+			for (int c = 0; c < count; c++)
+			{
+				const float* source = plane(first + c) + row;
+				float* target = out + (size_t)y * rect.width * count + c;
+				for (int i = 0; i < rect.width; i++)
+				{
+					float scale = 1.0f;
+					if (mean)
+						scale = samples[i] > 0 ? 1.0f / samples[i] : 0.0f;
+					target[i * count] = source[i] * scale;
+				}
+			}
+		}
+	}
+
+	// Portable float map of one or three channels, mean as in resolve.
+	bool write_pfm(const std::string& path, int first, int count, bool mean) const
+	{
+		if (count != 1 && count != 3) return false;
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file) return false;
+
+		std::vector<float> pixels(pixel_count() * count);
+		resolve(first, count, pixels.data(), mean);
+		fprintf(file, "%s\n%d %d\n-1.0\n", count == 3 ? "PF" : "Pf", plane_width, plane_height);
+		//rows are stored bottom to top, -1 marks little endian floats
+		bool ok = true;
+		for (int y = plane_height - 1; y >= 0 && ok; y--)
+		{
+			ok = fwrite(&pixels[(size_t)y * plane_width * count], sizeof(float), (size_t)plane_width * count, file) == (size_t)plane_width * count;
+		}
+		return fclose(file) == 0 && ok;
+	}
+
+private:
+	std::vector<float> planes[aov_channel_count];
+	int plane_width = 0;
+	int plane_height = 0;
+};
@@ -4,9 +4,15 @@
 #include "ray.h"
 #include "interval.h"
 #include "aabb.h";
+#include "simd.h"
+#include <cstdint>
+#include <atomic>
 
 class material;
+class hittable;
 
+// Intersection writes t, object, primitive and the barycentrics, the rest is filled by finalize
+// once the closest hit is known.
 class hit_record {
 public:
 	point3 p;
@@ -14,7 +20,24 @@ public:
 	double t;
 	double u, v;
 	bool front_face;
-	shared_ptr<material> mat;
+	const material* mat; //owned by the primitive that was hit, copying it must stay free of refcounting
+
+	const hittable* object = nullptr; //primitive that was hit, null once an instance shaded it in its own space
+	const hittable* instance = nullptr; //instance the hit was found through
+	uint32_t primitive = 0; //e.g. the triangle of a mesh
+	double bu = 0, bv = 0; //barycentrics, or the primitive's own surface coordinates
+
+	void set_hit(double _t, const hittable* _object, uint32_t _primitive = 0, double _bu = 0, double _bv = 0)
+	{
+		t = _t;
+		object = _object;
+		instance = nullptr;
+		primitive = _primitive;
+		bu = _bu;
+		bv = _bv;
+	}
+
+	inline void finalize(const ray& r);
 
 	void set_face_normal(const ray& r, const vec3& out_normal)
 	{
@@ -27,6 +50,71 @@ class hittable {
 public:
 	hittable() = default;
 	virtual ~hittable() = default;	
-	virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+	//unique in creation order, the object id output of the camera, 0 is left for misses
+	uint32_t id = next_id();
+
+	// Closest hit with the full shading record.
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const {
+		if (!intersect(r, ray_t, rec))
+			return false;
+		rec.finalize(r);
+		return true;
+	}
+
+	// Closest hit, only writing what hit_record::set_hit takes. rec is left alone on a miss,
+	// so a traversal can pass the same record to every candidate.
+	virtual bool intersect(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+	// Fills p, normal, uv and mat of a hit this object reported through intersect.
+	virtual void shade(const ray& r, hit_record& rec) const {}
+
 	virtual aabb bounding_box() const = 0;
+
+	// Any-hit query for shadow rays: true if anything blocks r within ray_t. Stops at the first
+	// intersection found and computes no hit record, the default falls back to hit.
+	virtual bool occluded(const ray& r, interval ray_t) const {
+		hit_record rec;
+		return intersect(r, ray_t, rec);
+	}
+
+	// Closest hit for every lane of mask at once. Lanes that found a closer hit get their record set as by
+	// intersect, their packet tmax shrunk and are returned as a mask. The default traces the lanes one by one.
+	virtual int hit_packet(ray_packet& packet, int mask, hit_record* recs) const {
+		int hits = 0;
+		for (int i = 0; i < packet.count; i++)
+		{
+			if ((mask >> i) & 1 && intersect(packet.rays[i], interval(packet.tmin, packet.tmax[i]), recs[i]))
+			{
+				packet.set_tmax(i, recs[i].t);
+				hits |= 1 << i;
+			}
+		}
+		return hits;
+	}
+
+	//light sampling, implemented by primitives that can carry an emissive material
+	virtual void collect_lights(std::vector<const hittable*>& lights) const {}
+
+	virtual double pdf_value(const point3& origin, const vec3& direction) const {
+		return 0.0;
+	}
+
+	virtual vec3 random(const point3& origin) const {
+		return vec3(1, 0, 0);
+	}
+
+private:
+	static uint32_t next_id() {
+		static std::atomic<uint32_t> counter{ 0 };
+		return ++counter;
+	}
 };
+
+void hit_record::finalize(const ray& r)
+{
+	if (instance)
+		instance->shade(r, *this);
+	else if (object)
+		object->shade(r, *this);
+}
@@ -22,26 +22,48 @@ public:
 		bbox = aabb(bbox, object->bounding_box());
 	}
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-		hit_record temprec;
+	bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+		//primitives only write rec when they report a hit, and every hit is closer than the last one
 		double closest_so_far=ray_t.max;
 		bool hit_anything = false;
 		for(const auto& object : objects){		
-			if (object->hit(r, interval(ray_t.min,closest_so_far), temprec))
+			if (object->intersect(r, interval(ray_t.min,closest_so_far), rec))
 			{
 				hit_anything = true;
-				closest_so_far = temprec.t;
-				rec = temprec;
+				closest_so_far = rec.t;
 			}
 		}
 		return hit_anything;
 	}
 
+	bool occluded(const ray& r, interval ray_t) const override {
+		for (const auto& object : objects) {
+			if (object->occluded(r, ray_t))
+				return true;
+		}
+		return false;
+	}
+
+	int hit_packet(ray_packet& packet, int mask, hit_record* recs) const override {
+		int hits = 0;
+		for (const auto& object : objects) {
+			hits |= object->hit_packet(packet, mask, recs);
+		}
+		return hits;
+	}
+
 	aabb bounding_box() const override
 	{
 		return bbox;
 	}
 
+	void collect_lights(std::vector<const hittable*>& lights) const override {
+		for (const auto& object : objects)
+		{
+			object->collect_lights(lights);
+		}
+	}
+
 private:
 	aabb bbox;
 };
\ No newline at end of file
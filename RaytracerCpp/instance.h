@@ -2,67 +2,131 @@
 
 #include "general.h"
 #include "hittable.h"
-#include "mat4.h";
+#include "mat3x4.h"
 
+// Places a shared object, e.g. a mesh with its own BVH, in the world with an affine transform. A bvh_node
+// over many instances is the top level of a two level hierarchy, the objects' BVHs are the bottom level.
+// Rays are moved into object space without normalizing the direction, so t is the same in both spaces.
 class instance : public hittable {
 public:
-	instance(shared_ptr<hittable>_obj, vec3 translation, vec3 rotation) :obj(_obj) {
-		 
-		translationmat = mat4::translation(translation);
-		rotationmat = mat4::rotation(rotation);
-		scalenmat = mat4::scale(vec3(1,1,1)); //implement scaling later
-
-		transformationmat = scalenmat * rotationmat * translationmat;
-		
-		invtranslationmat = translationmat.inverse();
-		invrotationmat = rotationmat.inverse();
-		invscalenmat = scalenmat.inverse();	
-		
+	//translated first, then rotated around the world origin, as scenes have always placed their instances;
+	//mat3x4::trs gives the usual scale, rotate, translate order
+	instance(shared_ptr<hittable>_obj, vec3 translation, vec3 rotation)
+		:instance(_obj, mat3x4(mat4::rotation(rotation) * mat4::translation(translation))) {};
+
+	instance(shared_ptr<hittable>_obj, const mat3x4& object_to_world) :obj(_obj), transformationmat(object_to_world) {
 		invtransformationmat = transformationmat.inverse();
+		jacobian = fabs(invtransformationmat.determinant());
 
 		bbox = obj->bounding_box().transform(transformationmat);
+		obj->collect_lights(object_lights);
 	};
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	bool intersect(const ray& r, interval ray_t, hit_record& rec) const override
 	{
-		auto o = toVec3(vec4(r.origin()) * invtransformationmat);
-		auto dir = toVec3(vec4(r.direction()) * invrotationmat);
-		auto new_ray = ray(o, dir);
+		auto new_ray = to_local(r);
+		if (!obj->intersect(new_ray, ray_t, rec))
+			return false;
 
-		/*auto near = r.at(ray_t.min);
-		auto far = r.at(ray_t.max);
+		claim(new_ray, rec);
+		return true;
+	}
 
-		near = toVec3(vec4(near) * invtranslationmat);
-		far = toVec3(vec4(far) * invtranslationmat);
+	// The hit point and normal of the closest hit are found in object space and transformed once.
+	void shade(const ray& r, hit_record& rec) const override
+	{
+		if (rec.object)
+			rec.object->shade(to_local(r), rec);
 
-		ray_t.min = dot(near - new_ray.origin(), new_ray.direction()) / dot(new_ray.direction(), new_ray.direction());
-		ray_t.max = dot(far - new_ray.origin(), new_ray.direction()) / dot(new_ray.direction(), new_ray.direction());*/
-		
-		if (!obj->hit(new_ray, ray_t, rec))
-			return false;
+		//the outward normal keeps front_face, a transform never changes which side the ray comes from
+		vec3 out_normal = rec.front_face ? rec.normal : -rec.normal;
+		rec.p = transformationmat.point(rec.p);
+		rec.set_face_normal(r, unit_vector(invtransformationmat.transposed_vector(out_normal)));
+	}
 
-		rec.p = toVec3(transformationmat * vec4(rec.p));
-		//rec.t = dot(rec.p - r.origin(), r.direction()) / dot(r.direction(), r.direction());
-		rec.set_face_normal(r, toVec3(vec4(rec.normal) * rotationmat));
+	bool occluded(const ray& r, interval ray_t) const override
+	{
+		return obj->occluded(to_local(r), ray_t);
+	}
 
-		return true;
+	int hit_packet(ray_packet& packet, int mask, hit_record* recs) const override
+	{
+		ray local[ray_packet::size];
+		for (int i = 0; i < packet.count; i++)
+		{
+			local[i] = to_local(packet.rays[i]);
+		}
+		ray_packet local_packet(local, packet.count, packet.tmin, infinity);
+		for (int i = 0; i < packet.count; i++)
+		{
+			local_packet.set_tmax(i, packet.tmax[i]);
+		}
+
+		int hits = obj->hit_packet(local_packet, mask, recs);
+		for (int i = 0; i < packet.count; i++)
+		{
+			if (!((hits >> i) & 1)) continue;
+			claim(local[i], recs[i]);
+			packet.set_tmax(i, recs[i].t);
+		}
+		return hits;
 	}
 
 	aabb bounding_box() const override {
 		return bbox;
 	}
 
+	void collect_lights(std::vector<const hittable*>& lights) const override {
+		if (!object_lights.empty())
+			lights.push_back(this);
+	}
+
+	double pdf_value(const point3& origin, const vec3& direction) const override {
+		auto o = invtransformationmat.point(origin);
+		auto dir = invtransformationmat.vector(direction);
+
+		double sum = 0;
+		for (auto light : object_lights)
+		{
+			sum += light->pdf_value(o, dir);
+		}
+
+		//densities are per solid angle, which a scaling transform stretches by |det| |d|^3 / |local d|^3
+		double ratio = direction.length() / dir.length();
+		return sum / object_lights.size() * jacobian * ratio * ratio * ratio;
+	}
+
+	const shared_ptr<hittable>& object() const { return obj; }
+
+	vec3 random(const point3& origin) const override {
+		auto o = invtransformationmat.point(origin);
+		auto light = object_lights[random_int(0, (int)object_lights.size() - 1)];
+		return transformationmat.vector(light->random(o));
+	}
+
 private:
 	shared_ptr<hittable> obj;
+	std::vector<const hittable*> object_lights;
 	aabb bbox;
-	mat4 translationmat;
-	mat4 rotationmat;
-	mat4 scalenmat;
-	mat4 invtranslationmat;
-	mat4 invrotationmat;
-	mat4 invscalenmat;
-
-	mat4 transformationmat;
-	mat4 invtransformationmat;
+	mat3x4 transformationmat; //object to world
+	mat3x4 invtransformationmat;
+	double jacobian; //volume scale of the world to object transform
+
+	ray to_local(const ray& r) const
+	{
+		return ray(invtransformationmat.point(r.origin()), invtransformationmat.vector(r.direction()));
+	}
+
+	//marks rec as found through this instance, a hit that already went through a nested instance is shaded
+	//right away because a record only remembers one instance
+	void claim(const ray& local, hit_record& rec) const
+	{
+		if (rec.instance)
+		{
+			rec.finalize(local);
+			rec.object = nullptr;
+		}
+		rec.instance = this;
+	}
 
 };
\ No newline at end of file
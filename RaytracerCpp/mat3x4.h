@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cmath>
+#include <stdexcept>
+#include "vec3.h"
+#include "mat4.h"
+
+// Affine transform stored as the top three rows of a 4x4 matrix, the last row is always 0 0 0 1.
+// Points use the translation column, vectors only the 3x3 linear part.
+class mat3x4 {
+public:
+	mat3x4() :e{ {0,0,0,0}, {0,0,0,0}, {0,0,0,0} } {};
+
+	explicit mat3x4(const mat4& m) {
+		for (int i = 0; i < 3; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				e[i][j] = m[i][j];
+			}
+		}
+	}
+
+	double* operator[](int i) {
+		return e[i];
+	}
+
+	const double* operator[](int i) const {
+		return e[i];
+	}
+
+	static mat3x4 identity() {
+		return mat3x4(mat4::identity());
+	}
+
+	// Scales, then rotates, then translates.
+	static mat3x4 trs(const vec3& translation, const vec3& rotation, const vec3& scale) {
+		return mat3x4(mat4::translation(translation) * mat4::rotation(rotation) * mat4::scale(scale));
+	}
+
+	vec3 point(const vec3& p) const {
+		return vec3(
+			e[0][0] * p[0] + e[0][1] * p[1] + e[0][2] * p[2] + e[0][3],
+			e[1][0] * p[0] + e[1][1] * p[1] + e[1][2] * p[2] + e[1][3],
+			e[2][0] * p[0] + e[2][1] * p[1] + e[2][2] * p[2] + e[2][3]
+		);
+	}
+
+	vec3 vector(const vec3& v) const {
+		return vec3(
+			e[0][0] * v[0] + e[0][1] * v[1] + e[0][2] * v[2],
+			e[1][0] * v[0] + e[1][1] * v[1] + e[1][2] * v[2],
+			e[2][0] * v[0] + e[2][1] * v[1] + e[2][2] * v[2]
+		);
+	}
+
+	// Multiplies by the transposed linear part. Called on the inverse transform this maps normals,
+	// which stay perpendicular to the surface under non-uniform scale.
+	vec3 transposed_vector(const vec3& v) const {
+		return vec3(
+			e[0][0] * v[0] + e[1][0] * v[1] + e[2][0] * v[2],
+			e[0][1] * v[0] + e[1][1] * v[1] + e[2][1] * v[2],
+			e[0][2] * v[0] + e[1][2] * v[1] + e[2][2] * v[2]
+		);
+	}
+
+	//of the linear part, the factor by which the transform scales volumes
+	double determinant() const {
+		return e[0][0] * (e[1][1] * e[2][2] - e[1][2] * e[2][1]) -
+			e[0][1] * (e[1][0] * e[2][2] - e[1][2] * e[2][0]) +
+			e[0][2] * (e[1][0] * e[2][1] - e[1][1] * e[2][0]);
+	}
+
+	mat3x4 inverse() const {
+		double det = determinant();
+		if (det == 0) {
+			throw std::runtime_error("Matrix is not invertible.");
+		}
+
+		mat3x4 inv;
+		inv[0][0] = (e[1][1] * e[2][2] - e[1][2] * e[2][1]) / det;
+		inv[0][1] = (e[0][2] * e[2][1] - e[0][1] * e[2][2]) / det;
+		inv[0][2] = (e[0][1] * e[1][2] - e[0][2] * e[1][1]) / det;
+		inv[1][0] = (e[1][2] * e[2][0] - e[1][0] * e[2][2]) / det;
+		inv[1][1] = (e[0][0] * e[2][2] - e[0][2] * e[2][0]) / det;
+		inv[1][2] = (e[0][2] * e[1][0] - e[0][0] * e[1][2]) / det;
+		inv[2][0] = (e[1][0] * e[2][1] - e[1][1] * e[2][0]) / det;
+		inv[2][1] = (e[0][1] * e[2][0] - e[0][0] * e[2][1]) / det;
+		inv[2][2] = (e[0][0] * e[1][1] - e[0][1] * e[1][0]) / det;
+
+		//the inverse translation is the translation moved back through the inverse linear part
+		vec3 t = inv.vector(vec3(e[0][3], e[1][3], e[2][3]));
+		inv[0][3] = -t[0];
+		inv[1][3] = -t[1];
+		inv[2][3] = -t[2];
+		return inv;
+	}
+
+	double e[3][4];
+};
+
+inline mat3x4 operator*(const mat3x4& a, const mat3x4& b) {
+	mat3x4 result;
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			result[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j] + (j == 3 ? a[i][3] : 0);
+		}
+	}
+	return result;
+}
@@ -12,6 +12,17 @@ public:
 	{
 		return color(0, 0, 0);
 	}
+
+	virtual bool is_emissive() const
+	{
+		return false;
+	}
+
+	//solid angle density scatter() draws its direction from, 0 for specular materials that can't be light sampled
+	virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+	{
+		return 0;
+	}
 };
 
 class lambertian : public material {
@@ -29,6 +40,12 @@ public:
 		attunation = albedo->value(rec.u,rec.v,rec.p);
 		return true;
 	}
+
+	double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+	{
+		auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+		return cos_theta < 0 ? 0 : cos_theta / pi;
+	}
 private:
 	shared_ptr<texture> albedo;
 };
@@ -105,6 +122,11 @@ public:
 		return emit->value(u, v, p);
 	}
 
+	bool is_emissive() const override
+	{
+		return true;
+	}
+
 private:
 	shared_ptr<texture> emit;
 };
\ No newline at end of file
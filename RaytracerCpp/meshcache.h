@@ -0,0 +1,220 @@
+#pragma once
+
+#include "general.h"
+#include "trianglemesh.h"
+#include "mappedfile.h"
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+
+// Binary copy of a loaded mesh next to its source file: the deduplicated vertex and index buffers and the
+// flattened BVH, so later loads map the file instead of parsing the text and building the tree again.
+// A cache is only used if it was written for the same source size and modification time, format version,
+// BVH layout and node sizes, anything else reparses the source and overwrites it.
+// Sections follow the header in this order, each padded to 64 bytes:
+// positions, normals, uvs, indices, BVH nodes, BVH indices.
+struct mesh_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout; //bvh_layout the nodes are stored in
+	uint32_t node_size; //sizeof the node type, guards against layout changes of the node structs
+	uint32_t smooth;
+	uint64_t source_size;
+	int64_t source_time;
+	uint64_t position_count; //floats
+	uint64_t normal_count;
+	uint64_t uv_count;
+	uint64_t index_count;
+	uint64_t node_count;
+	uint64_t tree_index_count;
+	float bounds[6]; //BVH root min xyz, max xyz
+};
+
+static const char mesh_cache_magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+//raised by every change to the layout or to what the OBJ parser produces, caches of older parsers would
+//otherwise keep matching their source's size and time
+static const uint32_t mesh_cache_version = 3;
+
+inline std::string mesh_cache_path(const std::string& source)
+{
+	return source + ".meshcache";
+}
+
+inline size_t mesh_cache_align(size_t offset)
+{
+	return (offset + 63) & ~(size_t)63;
+}
+
+inline uint32_t mesh_cache_node_size(bvh_layout layout)
+{
+	switch (layout)
+	{
+	case bvh_layout::wide4: return sizeof(bvh_wide_node<4>);
+	case bvh_layout::wide8: return sizeof(bvh_wide_node<8>);
+	default: return sizeof(bvh_linear_node);
+	}
+}
+
+//size and modification time of the source, false if it does not exist
+inline bool mesh_cache_source_stamp(const std::string& source, uint64_t& size, int64_t& time)
+{
+	std::error_code error;
+	size = (uint64_t)std::filesystem::file_size(source, error);
+	if (error) return false;
+	time = (int64_t)std::filesystem::last_write_time(source, error).time_since_epoch().count();
+	return !error;
+}
+
+// Reads the cache of source into a new mesh, null if there is no usable cache.
+inline shared_ptr<triangle_mesh> load_mesh_cache(const std::string& source, shared_ptr<material> mat)
+{
+	uint64_t source_size;
+	int64_t source_time;
+	if (!mesh_cache_source_stamp(source, source_size, source_time))
+		return nullptr;
+
+	mapped_file file;
+	if (!file.open(mesh_cache_path(source)) || file.size() < sizeof(mesh_cache_header))
+		return nullptr;
+
+	mesh_cache_header header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	const bvh_layout layout = (bvh_layout)header.layout;
+	if (std::memcmp(header.magic, mesh_cache_magic, sizeof(mesh_cache_magic)) != 0 || header.version != mesh_cache_version
+		|| header.source_size != source_size || header.source_time != source_time
+		|| layout != bvh_tree::default_layout || header.node_size != mesh_cache_node_size(layout))
+		return nullptr;
+
+	//every section has to lie inside the file before anything is copied
+	const uint64_t sizes[] = {
+		header.position_count * sizeof(float), header.normal_count * sizeof(float), header.uv_count * sizeof(float),
+		header.index_count * sizeof(uint32_t), header.node_count * header.node_size, header.tree_index_count * sizeof(uint32_t)
+	};
+	size_t offsets[6];
+	size_t offset = mesh_cache_align(sizeof(header));
+	for (int i = 0; i < 6; i++)
+	{
+		if (sizes[i] > file.size() || offset > file.size() - sizes[i])
+			return nullptr;
+		offsets[i] = offset;
+		offset = mesh_cache_align(offset + (size_t)sizes[i]);
+	}
+
+	auto mesh = make_shared<triangle_mesh>(mat);
+	auto section = [&](int i) { return file.data() + offsets[i]; };
+	mesh->positions.assign((const float*)section(0), (const float*)section(0) + header.position_count);
+	mesh->normals.assign((const float*)section(1), (const float*)section(1) + header.normal_count);
+	mesh->uvs.assign((const float*)section(2), (const float*)section(2) + header.uv_count);
+	mesh->indices.assign((const uint32_t*)section(3), (const uint32_t*)section(3) + header.index_count);
+	mesh->smooth = header.smooth != 0;
+
+	bvh_tree& tree = mesh->bvh();
+	if (layout == bvh_layout::wide4)
+		tree.nodes4.assign((const bvh_wide_node<4>*)section(4), (const bvh_wide_node<4>*)section(4) + header.node_count);
+	else if (layout == bvh_layout::wide8)
+		tree.nodes8.assign((const bvh_wide_node<8>*)section(4), (const bvh_wide_node<8>*)section(4) + header.node_count);
+	else
+		tree.nodes.assign((const bvh_linear_node*)section(4), (const bvh_linear_node*)section(4) + header.node_count);
+	tree.indices.assign((const uint32_t*)section(5), (const uint32_t*)section(5) + header.tree_index_count);
+
+	const float* b = header.bounds;
+	tree.restore(layout, aabb(point3(b[0], b[1], b[2]), point3(b[3], b[4], b[5])));
+	mesh->restored();
+
+	//sizes that agree with each other can still describe buffers that do not fit together
+	const size_t vertices = mesh->vertex_count();
+	if (mesh->triangle_count() == 0 || header.index_count % 3 != 0 || header.position_count % 3 != 0
+		|| (header.normal_count != 0 && header.normal_count != header.position_count)
+		|| (header.uv_count != 0 && header.uv_count != vertices * 2))
+		return nullptr;
+	for (uint32_t index : mesh->indices)
+	{
+		if (index >= vertices) return nullptr;
+	}
+	if (!tree.valid(mesh->triangle_count()))
+		return nullptr;
+	return mesh;
+}
+
+// Writes the cache of a built mesh next to source. A failed write only costs the next load its speed.
+inline bool save_mesh_cache(const triangle_mesh& mesh, const std::string& source)
+{
+	mesh_cache_header header = {};
+	if (!mesh_cache_source_stamp(source, header.source_size, header.source_time))
+		return false;
+
+	const bvh_tree& tree = mesh.bvh();
+	std::memcpy(header.magic, mesh_cache_magic, sizeof(mesh_cache_magic));
+	header.version = mesh_cache_version;
+	header.layout = (uint32_t)tree.layout;
+	header.node_size = mesh_cache_node_size(tree.layout);
+	header.smooth = mesh.smooth ? 1 : 0;
+	header.position_count = mesh.positions.size();
+	header.normal_count = mesh.normals.size();
+	header.uv_count = mesh.uvs.size();
+	header.index_count = mesh.indices.size();
+	header.tree_index_count = tree.indices.size();
+
+	const char* nodes;
+	if (tree.layout == bvh_layout::wide4)
+	{
+		header.node_count = tree.nodes4.size();
+		nodes = (const char*)tree.nodes4.data();
+	}
+	else if (tree.layout == bvh_layout::wide8)
+	{
+		header.node_count = tree.nodes8.size();
+		nodes = (const char*)tree.nodes8.data();
+	}
+	else
+	{
+		header.node_count = tree.nodes.size();
+		nodes = (const char*)tree.nodes.data();
+	}
+
+	const aabb bounds = tree.bounding_box();
+	const float b[6] = {
+		(float)bounds.x.min, (float)bounds.y.min, (float)bounds.z.min,
+		(float)bounds.x.max, (float)bounds.y.max, (float)bounds.z.max
+	};
+	std::memcpy(header.bounds, b, sizeof(b));
+
+	//written under a temporary name and renamed, so a reader never maps a half written cache
+	const std::string path = mesh_cache_path(source);
+	const std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		if (!out) return false;
+
+		size_t offset = 0;
+		auto write = [&](const void* data, size_t size) {
+			out.write((const char*)data, (std::streamsize)size);
+			offset += size;
+			static const char zeros[64] = {};
+			size_t padding = mesh_cache_align(offset) - offset;
+			out.write(zeros, (std::streamsize)padding);
+			offset += padding;
+		};
+		write(&header, sizeof(header));
+		write(mesh.positions.data(), mesh.positions.size() * sizeof(float));
+		write(mesh.normals.data(), mesh.normals.size() * sizeof(float));
+		write(mesh.uvs.data(), mesh.uvs.size() * sizeof(float));
+		write(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+		write(nodes, (size_t)header.node_count * header.node_size);
+		write(tree.indices.data(), tree.indices.size() * sizeof(uint32_t));
+		if (!out) return false;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporary, path, error);
+	if (error)
+	{
+		std::filesystem::remove(temporary, error);
+		return false;
+	}
+	return true;
+}
@@ -2,121 +2,408 @@
 
 #include "general.h"
 #include "hittablelist.h"
-#include "triangle.h"
+#include "trianglemesh.h"
+#include "meshcache.h"
+#include "mappedfile.h"
+#include "threadpool.h"
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <sstream>
-#include <filesystem>
+#include <string_view>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
 using namespace std;
 
+// Corners that repeat the same position/uv/normal triple share one vertex.
+struct obj_corner {
+	int position, uv, normal;
 
-static vector<string> split(string s, char c) {
-	stringstream ss(s);
-	vector<string> temp;
-	string st;
-	while (getline(ss, st, c)) {
-		temp.push_back(st);
+	bool operator==(const obj_corner& o) const {
+		return position == o.position && uv == o.uv && normal == o.normal;
 	}
-	return temp;
-}
-static shared_ptr<hittable_list> LoadMesh(string path, shared_ptr<material> mat)
-{
-	shared_ptr<hittable_list> mesh = make_shared<hittable_list>();
-	vector<shared_ptr<vertex>> vertices;
-	vector<int> indices;
+};
 
-	string extension = path.substr(path.length() - 4, 4);
-	if (extension != ".obj") {
+struct obj_corner_hash {
+	size_t operator()(const obj_corner& c) const {
+		return (size_t)hash_mix(((uint64_t)(uint32_t)c.position << 32) ^ ((uint64_t)(uint32_t)c.uv << 16) ^ (uint64_t)(uint32_t)c.normal);
+	}
+};
 
-		cout << "Couldnt load mesh!!";
-		return mesh;
+// Everything one chunk of an OBJ file declares. Chunks are parsed independently, so a negative (relative)
+// face index can only be resolved against the chunk's own counts; it is stored relative to the chunk start
+// with its bit set in relative, and moved to the absolute index once the counts of earlier chunks are known.
+struct obj_chunk {
+	vector<float> positions; //xyz
+	vector<float> uvs; //uv
+	vector<float> normals; //xyz
+	vector<obj_corner> corners; //-1 for a missing uv or normal
+	vector<uint8_t> relative; //per corner: 1 position, 2 uv, 4 normal
+	vector<uint32_t> face_sizes;
+	string error;
+
+	static const uint8_t relative_position = 1, relative_uv = 2, relative_normal = 4;
+};
+
+// Whitespace separated numbers with std::from_chars, no allocations and no locale.
+struct obj_line_reader {
+	const char* p;
+	const char* end;
+
+	void skip_spaces() {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
 	}
-	else {
 
-		vector<vec3> pos;
-		vector <vec3> tex;
-		vector <vec3> norm;
+	bool at_end() {
+		skip_spaces();
+		return p >= end;
+	}
 
+	bool read(float& value) {
+		skip_spaces();
+		if (p < end && *p == '+') p++;
+		double d;
+		auto result = std::from_chars(p, end, d);
+		if (result.ec != std::errc()) return false;
+		p = result.ptr;
+		value = (float)d;
+		return true;
+	}
 
-		fstream in;
-		in.open(path.c_str());
+	bool read(int& value) {
+		if (p < end && *p == '+') p++;
+		auto result = std::from_chars(p, end, value);
+		if (result.ec != std::errc()) return false;
+		p = result.ptr;
+		return true;
+	}
 
+	//the keyword at the start of the line, e.g. "v" or "f"
+	string_view keyword() {
+		skip_spaces();
+		const char* start = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+		return string_view(start, p - start);
+	}
+};
 
-		string line;
-		vector<string> tokens;
-		while (in) {
-			getline(in, line);
-			tokens = split(line, ' ');
-			if (line.length() == 0) { break; }
-			if (tokens[0] == "#") {
-				continue;
-			}
-			else if (tokens[0] == "v") {				
-				auto x = stod(tokens[1]);
-				auto y = stod(tokens[2]);
-				auto z = stod(tokens[3]);
-				pos.push_back(vec3(x, y, z));
-			}
-			else if (tokens[0] == "vt") {
-				
-				auto x = stod(tokens[1]);
-				auto y = stod(tokens[2]);
-				tex.push_back(vec3(x, y,0));
+// One-based OBJ index to a zero-based one, negative indices count back from the last element declared so far.
+inline bool obj_resolve_index(int index, size_t declared, int& resolved, uint8_t& relative, uint8_t bit)
+{
+	if (index > 0)
+	{
+		resolved = index - 1;
+		return true;
+	}
+	if (index < 0)
+	{
+		resolved = (int)declared + index;
+		relative |= bit;
+		return true;
+	}
+	return false;
+}
+
+inline void parse_obj_line(const char* begin, const char* end, obj_chunk& chunk)
+{
+	obj_line_reader line{ begin, end };
+	string_view keyword = line.keyword();
+	if (keyword.empty() || keyword[0] == '#')
+		return;
+
+	if (keyword == "v")
+	{
+		float x = 0, y = 0, z = 0;
+		if (!line.read(x) || !line.read(y) || !line.read(z))
+			chunk.error = "bad vertex position";
+		chunk.positions.insert(chunk.positions.end(), { x, y, z });
+	}
+	else if (keyword == "vt")
+	{
+		float u = 0, v = 0;
+		if (!line.read(u))
+			chunk.error = "bad texture coordinate";
+		line.read(v);
+		chunk.uvs.insert(chunk.uvs.end(), { u, v });
+	}
+	else if (keyword == "vn")
+	{
+		float x = 0, y = 0, z = 0;
+		if (!line.read(x) || !line.read(y) || !line.read(z))
+			chunk.error = "bad vertex normal";
+		chunk.normals.insert(chunk.normals.end(), { x, y, z });
+	}
+	else if (keyword == "f")
+	{
+		uint32_t count = 0;
+		while (!line.at_end())
+		{
+			obj_corner corner{ 0, -1, -1 };
+			uint8_t relative = 0;
+			int index;
+			bool ok = line.read(index) && obj_resolve_index(index, chunk.positions.size() / 3, corner.position, relative, obj_chunk::relative_position);
+			if (ok && line.p < line.end && *line.p == '/')
+			{
+				line.p++;
+				if (line.p < line.end && *line.p != '/')
+					ok = line.read(index) && obj_resolve_index(index, chunk.uvs.size() / 2, corner.uv, relative, obj_chunk::relative_uv);
+				if (ok && line.p < line.end && *line.p == '/')
+				{
+					line.p++;
+					ok = line.read(index) && obj_resolve_index(index, chunk.normals.size() / 3, corner.normal, relative, obj_chunk::relative_normal);
+				}
 			}
-			else if (tokens[0] == "vn") {				
-				auto x = stod(tokens[1]);
-				auto y = stod(tokens[2]);
-				auto z = stod(tokens[3]);
-				norm.push_back(vec3(x, y, z));
+			if (!ok)
+			{
+				chunk.error = "bad face index";
+				chunk.corners.resize(chunk.corners.size() - count);
+				chunk.relative.resize(chunk.relative.size() - count);
+				return;
 			}
-			else if (tokens[0] == "f") {				
-				vector<string> t;
-				for (string x : tokens) {
-					
-					if (x == "f") { continue; }
-
-					
-					t = split(x, '/');
-					auto vtemp = make_shared<vertex>();
-					vtemp->position = pos[stoi(t[0]) - 1];
-
-					if (t.size() > 1) {
-						vtemp->u = tex[stoi(t[1]) - 1][0];
-						vtemp->v = tex[stoi(t[1]) - 1][1];
-					}
-					if (t.size() > 2)
-						vtemp->normal = norm[stoi(t[2]) - 1];
+			chunk.corners.push_back(corner);
+			chunk.relative.push_back(relative);
+			count++;
+		}
+		//points and lines are not surfaces
+		if (count < 3)
+		{
+			chunk.corners.resize(chunk.corners.size() - count);
+			chunk.relative.resize(chunk.relative.size() - count);
+			return;
+		}
+		chunk.face_sizes.push_back(count);
+	}
+}
 
-					vertices.push_back(vtemp);
-					indices.push_back(vertices.size() - 1);
-					t.clear();
-				}
-				if (tokens.size() == 5)
-				{
-					int end = vertices.size() - 1;
-					indices.push_back(end - 3);
-					indices.push_back(end - 1);
-				}				
+inline void parse_obj_chunk(const char* begin, const char* end, obj_chunk& chunk)
+{
+	const char* p = begin;
+	while (p < end && chunk.error.empty())
+	{
+		const char* line_end = (const char*)memchr(p, '\n', end - p);
+		if (!line_end) line_end = end;
+		parse_obj_line(p, line_end, chunk);
+		p = line_end + 1;
+	}
+}
 
+// Vertices of faces written without normals get the area weighted normal of the faces they belong to,
+// a smooth mesh would otherwise interpolate their zero normal into a NaN.
+static void fill_missing_normals(triangle_mesh& mesh, const vector<uint8_t>& without_normal)
+{
+	if (std::find(without_normal.begin(), without_normal.end(), 1) == without_normal.end())
+		return;
+	for (size_t t = 0; t < mesh.triangle_count(); t++)
+	{
+		const uint32_t* tri = &mesh.indices[t * 3];
+		if (!without_normal[tri[0]] && !without_normal[tri[1]] && !without_normal[tri[2]])
+			continue;
+		const float* p0 = &mesh.positions[(size_t)tri[0] * 3];
+		const float* p1 = &mesh.positions[(size_t)tri[1] * 3];
+		const float* p2 = &mesh.positions[(size_t)tri[2] * 3];
+		const float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		const float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		//unnormalized, its length is twice the area
+		const float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+		for (int k = 0; k < 3; k++)
+		{
+			if (!without_normal[tri[k]]) continue;
+			float* target = &mesh.normals[(size_t)tri[k] * 3];
+			target[0] += n[0];
+			target[1] += n[1];
+			target[2] += n[2];
+		}
+	}
+	for (size_t v = 0; v < without_normal.size(); v++)
+	{
+		if (!without_normal[v]) continue;
+		float* n = &mesh.normals[v * 3];
+		const float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (length > 0)
+		{
+			n[0] /= length;
+			n[1] /= length;
+			n[2] /= length;
+		}
+		else
+		{
+			//only on degenerate faces, which are never hit
+			n[0] = 0;
+			n[1] = 1;
+			n[2] = 0;
+		}
+	}
+}
+
+// Parses the OBJ text into mesh's buffers. The text is split at line breaks into chunks that are parsed
+// in parallel on the pool, the chunks are then merged in file order, which keeps the vertex order
+// independent of the chunking. n-gons are split into a triangle fan.
+inline void parse_obj(const char* text, size_t size, triangle_mesh& mesh, thread_pool* pool)
+{
+	const size_t min_chunk_size = 1 << 20;
+	size_t chunk_count = pool ? (size_t)pool->size() * 4 : 1;
+	chunk_count = std::max<size_t>(1, std::min(chunk_count, size / min_chunk_size));
+
+	vector<const char*> bounds(chunk_count + 1);
+	bounds[0] = text;
+	bounds[chunk_count] = text + size;
+	for (size_t i = 1; i < chunk_count; i++)
+	{
+		const char* p = std::max(bounds[i - 1], text + size * i / chunk_count);
+		const char* line_end = (const char*)memchr(p, '\n', text + size - p);
+		bounds[i] = line_end ? line_end + 1 : text + size;
+	}
+
+	vector<obj_chunk> chunks(chunk_count);
+	if (pool && chunk_count > 1)
+	{
+		task_group tasks(*pool);
+		for (size_t i = 0; i < chunk_count; i++)
+		{
+			tasks.run([&, i] { parse_obj_chunk(bounds[i], bounds[i + 1], chunks[i]); });
+		}
+		tasks.wait();
+	}
+	else
+	{
+		parse_obj_chunk(bounds[0], bounds[1], chunks[0]);
+	}
+
+	//element counts declared before each chunk, for the relative indices
+	size_t position_total = 0, uv_total = 0, normal_total = 0, corner_total = 0;
+	vector<size_t> position_base(chunk_count), uv_base(chunk_count), normal_base(chunk_count);
+	for (size_t i = 0; i < chunk_count; i++)
+	{
+		if (!chunks[i].error.empty())
+			throw std::runtime_error("Failed parsing mesh: " + chunks[i].error);
+		position_base[i] = position_total;
+		uv_base[i] = uv_total;
+		normal_base[i] = normal_total;
+		position_total += chunks[i].positions.size() / 3;
+		uv_total += chunks[i].uvs.size() / 2;
+		normal_total += chunks[i].normals.size() / 3;
+		corner_total += chunks[i].corners.size();
+	}
+
+	vector<float> positions, uvs, normals;
+	positions.reserve(position_total * 3);
+	uvs.reserve(uv_total * 2);
+	normals.reserve(normal_total * 3);
+	for (auto& chunk : chunks)
+	{
+		positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+		uvs.insert(uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+		normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+		chunk.positions = vector<float>();
+		chunk.uvs = vector<float>();
+		chunk.normals = vector<float>();
+	}
+
+	unordered_map<obj_corner, uint32_t, obj_corner_hash> vertex_lookup;
+	vertex_lookup.reserve(corner_total / 2);
+	mesh.positions.reserve(position_total * 3);
+	mesh.indices.reserve(corner_total * 3);
+	vector<uint32_t> face;
+	vector<uint8_t> without_normal; //per vertex, corners that had no vn in a file that has normals
+	for (size_t c = 0; c < chunk_count; c++)
+	{
+		const obj_chunk& chunk = chunks[c];
+		size_t next = 0;
+		for (uint32_t face_size : chunk.face_sizes)
+		{
+			face.clear();
+			for (uint32_t k = 0; k < face_size; k++, next++)
+			{
+				obj_corner corner = chunk.corners[next];
+				const uint8_t relative = chunk.relative[next];
+				if (relative & obj_chunk::relative_position) corner.position += (int)position_base[c];
+				if (relative & obj_chunk::relative_uv) corner.uv += (int)uv_base[c];
+				if (relative & obj_chunk::relative_normal) corner.normal += (int)normal_base[c];
+				if (corner.position < 0 || (size_t)corner.position >= position_total
+					|| corner.uv >= (int)uv_total || corner.normal >= (int)normal_total
+					|| ((relative & obj_chunk::relative_uv) && corner.uv < 0) || ((relative & obj_chunk::relative_normal) && corner.normal < 0))
+					throw std::runtime_error("Failed parsing mesh: face index out of range");
+
+				auto found = vertex_lookup.find(corner);
+				if (found == vertex_lookup.end())
+				{
+					const float* p = &positions[(size_t)corner.position * 3];
+					mesh.positions.insert(mesh.positions.end(), { p[0], p[1], p[2] });
+					if (corner.uv >= 0)
+						mesh.uvs.insert(mesh.uvs.end(), { uvs[(size_t)corner.uv * 2], uvs[(size_t)corner.uv * 2 + 1] });
+					else
+						mesh.uvs.insert(mesh.uvs.end(), { 0.0f, 0.0f });
+					if (corner.normal >= 0)
+					{
+						const float* n = &normals[(size_t)corner.normal * 3];
+						mesh.normals.insert(mesh.normals.end(), { n[0], n[1], n[2] });
+					}
+					else
+						mesh.normals.insert(mesh.normals.end(), { 0.0f, 0.0f, 0.0f });
+					without_normal.push_back(corner.normal < 0);
+					found = vertex_lookup.emplace(corner, (uint32_t)(mesh.vertex_count() - 1)).first;
+				}
+				face.push_back(found->second);
 			}
-			else {
-				continue;
+			for (size_t k = 1; k + 1 < face.size(); k++)
+			{
+				mesh.add_triangle(face[0], face[k], face[k + 1]);
 			}
 		}
 	}
 
-	for (size_t i = 0; i < indices.size(); i += 3)
+	if (normal_total == 0) mesh.normals.clear();
+	else fill_missing_normals(mesh, without_normal);
+	if (uv_total == 0) mesh.uvs.clear();
+}
+
+//when set, LoadMesh keeps a binary cache next to every .obj it parses and loads that instead while it is current
+static bool use_mesh_cache = true;
+
+static shared_ptr<triangle_mesh> LoadMesh(string path, shared_ptr<material> mat, thread_pool* pool = nullptr)
+{
+	if (use_mesh_cache && path.length() >= 4 && path.substr(path.length() - 4, 4) == ".obj")
 	{
-		auto tri = make_shared<triangle>(vertices[indices[i]], vertices[indices[i+1]], vertices[indices[i+2]], mat);
-		mesh->add(tri);
+		if (auto cached = load_mesh_cache(path, mat))
+		{
+			std::cout << "Loaded " << path << " from cache: " << cached->triangle_count() << " triangles, " << cached->vertex_count() << " vertices\n";
+			return cached;
+		}
+	}
+
+	shared_ptr<triangle_mesh> mesh = make_shared<triangle_mesh>(mat);
+
+	string extension = path.length() >= 4 ? path.substr(path.length() - 4, 4) : path;
+	if (extension != ".obj") {
+
+		cout << "Couldnt load mesh!!";
+		return mesh;
+	}
+	else {
+		mapped_file file;
+		if (!file.open(path))
+		{
+			throw std::runtime_error("Failed loading mesh " + path);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		parse_obj(file.data(), file.size(), *mesh, pool);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double megabytes = file.size() / (1024.0 * 1024.0);
+		std::cout << "Parsed " << path << ": " << megabytes << " MB in " << seconds * 1000 << " ms, " << megabytes / std::max(seconds, 1e-9) << " MB/s\n";
 	}
-	
-	if (mesh->objects.size() == 0)
+
+	if (mesh->triangle_count() == 0)
 	{
 		throw std::runtime_error("Failed loading mesh");
 	}
-	
+
+	mesh->build(pool);
+	std::cout << "Loaded " << path << ": " << mesh->triangle_count() << " triangles, " << mesh->vertex_count() << " vertices\n";
+	if (use_mesh_cache && !save_mesh_cache(*mesh, path))
+		std::cout << "Could not write the mesh cache of " << path << "\n";
+
 	return mesh;
 }
-
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "vec3.h"
+
+// orthonormal basis around a direction, w is the given axis
+class onb {
+public:
+	onb(const vec3& n) {
+		axis[2] = unit_vector(n);
+		vec3 a = (fabs(axis[2].x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		axis[1] = unit_vector(cross(axis[2], a));
+		axis[0] = cross(axis[2], axis[1]);
+	}
+
+	const vec3& u() const { return axis[0]; }
+	const vec3& v() const { return axis[1]; }
+	const vec3& w() const { return axis[2]; }
+
+	vec3 transform(const vec3& local) const {
+		return (local[0] * axis[0]) + (local[1] * axis[1]) + (local[2] * axis[2]);
+	}
+
+private:
+	vec3 axis[3];
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "glad/gl.h"
+#include "framebuffer.h"
+#include "tonemap.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+enum class preview_format { rgba8, rgba16f, rgb32f };
+
+// Display texture of the render. Storage is allocated once per size, immutable where the driver offers
+// glTexStorage2D. Changed regions are packed into one of two pixel buffer objects and copied with
+// glTexSubImage2D from there, so the driver transfers them while the next frame fills the other buffer.
+// The image is expected tone mapped, which 8 bits or half floats carry at a third or two thirds of the
+// bandwidth of the float rgb it used to be uploaded as; rgb32f keeps exact floats.
+class preview_texture {
+public:
+	// Needs a current GL context, load resolves the entry points glad does not cover.
+	explicit preview_texture(GLADloadfunc load)
+	{
+		create_texture();
+		glGenBuffers(2, buffers);
+
+		//the loader was generated for GL 3.0, texture storage is core in 4.2 and an extension before
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		bool storage = major > 4 || (major == 4 && minor >= 2);
+		GLint extensions = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+		for (GLint i = 0; i < extensions && !storage; i++)
+		{
+			const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+			storage = name && std::strcmp(name, "GL_ARB_texture_storage") == 0;
+		}
+		if (storage)
+			tex_storage_2d = (tex_storage_2d_proc)load("glTexStorage2D");
+	}
+
+	~preview_texture()
+	{
+		glDeleteBuffers(2, buffers);
+		glDeleteTextures(1, &texture);
+	}
+
+	preview_texture(const preview_texture&) = delete;
+	preview_texture& operator=(const preview_texture&) = delete;
+
+	GLuint id() const { return texture; }
+
+	// Uploads the regions of display, rgb floats of width * height pixels in [0,1]. A new size or format
+	// allocates new storage and uploads the whole image.
+	void upload(const float* display, int width, int height, preview_format format, const std::vector<tile_rect>& regions)
+	{
+		const bool resized = width != texture_width || height != texture_height || format != texture_format;
+		if (resized)
+			allocate(width, height, format);
+
+		const std::vector<tile_rect> whole = { { 0, 0, width, height } };
+		const std::vector<tile_rect>& changed = resized ? whole : regions;
+		size_t bytes = 0;
+		for (const tile_rect& r : changed)
+		{
+			bytes += (size_t)r.width * r.height * pixel_size();
+		}
+		if (bytes == 0) return;
+
+		//invalidating orphans the storage the previous upload from this buffer may still be reading
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[next]);
+		if (bytes > buffer_size[next])
+		{
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)bytes, nullptr, GL_STREAM_DRAW);
+			buffer_size[next] = bytes;
+		}
+		uint8_t* mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, (GLsizeiptr)bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (!mapped)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return;
+		}
+		size_t offset = 0;
+		for (const tile_rect& r : changed)
+		{
+			for (int y = r.y; y < r.y + r.height; y++)
+			{
+				convert(display + ((size_t)y * width + r.x) * 3, mapped + offset, r.width);
+				offset += (size_t)r.width * pixel_size();
+			}
+		}
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		offset = 0;
+		for (const tile_rect& r : changed)
+		{
+			glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.width, r.height, pixel_format(), pixel_type(), (const void*)offset);
+			offset += (size_t)r.width * r.height * pixel_size();
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		next = 1 - next;
+	}
+
+private:
+	typedef void (GLAD_API_PTR *tex_storage_2d_proc)(GLenum target, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height);
+
+	GLuint texture = 0;
+	GLuint buffers[2] = {};
+	size_t buffer_size[2] = {};
+	int next = 0;
+	int texture_width = 0, texture_height = 0;
+	preview_format texture_format = preview_format::rgba8;
+	tex_storage_2d_proc tex_storage_2d = nullptr;
+	std::vector<uint8_t> row; //8 bit rgb of one row before it is widened to rgba
+
+	size_t pixel_size() const
+	{
+		switch (texture_format)
+		{
+		case preview_format::rgba16f: return 8;
+		case preview_format::rgb32f: return 12;
+		default: return 4;
+		}
+	}
+
+	GLenum internal_format() const
+	{
+		switch (texture_format)
+		{
+		case preview_format::rgba16f: return GL_RGBA16F;
+		case preview_format::rgb32f: return GL_RGB32F;
+		default: return GL_RGBA8;
+		}
+	}
+
+	GLenum pixel_format() const { return texture_format == preview_format::rgb32f ? GL_RGB : GL_RGBA; }
+
+	GLenum pixel_type() const
+	{
+		switch (texture_format)
+		{
+		case preview_format::rgba16f: return GL_HALF_FLOAT;
+		case preview_format::rgb32f: return GL_FLOAT;
+		default: return GL_UNSIGNED_BYTE;
+		}
+	}
+
+	void create_texture()
+	{
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	}
+
+	void allocate(int width, int height, preview_format format)
+	{
+		//immutable storage cannot be resized, a new size needs a new texture
+		if (tex_storage_2d && texture_width > 0)
+		{
+			glDeleteTextures(1, &texture);
+			create_texture();
+		}
+		texture_width = width;
+		texture_height = height;
+		texture_format = format;
+
+		glBindTexture(GL_TEXTURE_2D, texture);
+		if (tex_storage_2d)
+			tex_storage_2d(GL_TEXTURE_2D, 1, internal_format(), width, height);
+		else
+			glTexImage2D(GL_TEXTURE_2D, 0, internal_format(), width, height, 0, pixel_format(), pixel_type(), nullptr);
+	}
+
+	void convert(const float* rgb, uint8_t* out, int count)
+	{
+		if (texture_format == preview_format::rgb32f)
+		{
+			std::memcpy(out, rgb, (size_t)count * 12);
+		}
+		else if (texture_format == preview_format::rgba16f)
+		{
+			uint16_t* half = (uint16_t*)out;
+			for (int i = 0; i < count; i++)
+			{
+				half[i * 4] = float_to_half(rgb[i * 3]);
+				half[i * 4 + 1] = float_to_half(rgb[i * 3 + 1]);
+				half[i * 4 + 2] = float_to_half(rgb[i * 3 + 2]);
+				half[i * 4 + 3] = 0x3c00; //1.0
+			}
+		}
+		else
+		{
+			row.resize((size_t)count * 3);
+			quantize(rgb, row.data(), row.size());
+			for (int i = 0; i < count; i++)
+			{
+				out[i * 4] = row[i * 3];
+				out[i * 4 + 1] = row[i * 3 + 1];
+				out[i * 4 + 2] = row[i * 3 + 2];
+				out[i * 4 + 3] = 255;
+			}
+		}
+	}
+
+	//rounded to nearest, values too small for a normal half flush to zero
+	static uint16_t float_to_half(float value)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		const uint32_t sign = (bits >> 16) & 0x8000;
+		const int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+		const uint32_t mantissa = bits & 0x7fffff;
+		if (exponent <= 0) return (uint16_t)sign;
+		if (exponent >= 31) return (uint16_t)(sign | 0x7c00);
+		return (uint16_t)(sign | (((uint32_t)exponent << 10) + ((mantissa + 0x1000) >> 13)));
+	}
+};
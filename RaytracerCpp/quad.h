@@ -2,6 +2,7 @@
 
 #include "general.h";
 #include "hittable.h";
+#include "material.h"
 
 class quad : public hittable {
 public:
@@ -12,6 +13,7 @@ public:
 
 		normal = unit_vector(n);
 		D = dot(normal, Q);	
+		area = n.length();
 
 		set_bounding_box();
 	};
@@ -24,34 +26,49 @@ public:
 		return bbox;
 	}
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override 
+	bool intersect(const ray& r, interval ray_t, hit_record& rec) const override 
 	{
-		auto ndotd = dot(normal, r.direction());
-
-		if (fabs(ndotd) < 1e-8) 
+		double t, alpha, beta;
+		if (!plane_hit(r, ray_t, t, alpha, beta))
 			return false;
 
-		auto t = (D - dot(normal, r.origin()))/ndotd;
+		rec.set_hit(t, this, 0, alpha, beta);
+		return true;
+	}
 
-		if (!ray_t.contains(t))
-			return false;
+	void shade(const ray& r, hit_record& rec) const override
+	{
+		is_interior(rec.bu, rec.bv, rec);
+		rec.p = r.at(rec.t);
+		rec.mat = mat.get();
+		rec.set_face_normal(r, normal);
+	}
 
-		auto intersection = r.at(t);
+	bool occluded(const ray& r, interval ray_t) const override
+	{
+		double t, alpha, beta;
+		return plane_hit(r, ray_t, t, alpha, beta);
+	}
 
-		vec3 p = intersection - Q;
+	void collect_lights(std::vector<const hittable*>& lights) const override {
+		if (mat->is_emissive())
+			lights.push_back(this);
+	}
 
-		auto alpha = dot(w, cross(p,v));
-		auto beta = dot(w, cross(u, p));
+	double pdf_value(const point3& origin, const vec3& direction) const override {
+		hit_record rec;
+		if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+			return 0;
 
-		if (!is_interior(alpha, beta, rec))
-			return false;		
+		auto distance_squared = rec.t * rec.t * direction.length_squared();
+		auto cosine = fabs(dot(direction, rec.normal) / direction.length());
 
-		rec.t = t;
-		rec.p = intersection;
-		rec.mat = mat;
-		rec.set_face_normal(r, normal);
-		return true;
+		return distance_squared / (cosine * area);
+	}
 
+	vec3 random(const point3& origin) const override {
+		auto p = Q + (random_double() * u) + (random_double() * v);
+		return p - origin;
 	}
 
 	virtual bool is_interior(double a, double b, hit_record& rec) const {
@@ -69,6 +86,30 @@ private:
 	shared_ptr<material> mat;
 	vec3 normal;
 	double D;
+	double area;
 	aabb bbox;
 	vec3 w;
+
+	bool plane_hit(const ray& r, const interval& ray_t, double& t, double& alpha, double& beta) const
+	{
+		auto ndotd = dot(normal, r.direction());
+
+		if (fabs(ndotd) < 1e-8) 
+			return false;
+
+		t = (D - dot(normal, r.origin()))/ndotd;
+
+		if (!ray_t.contains(t))
+			return false;
+
+		auto intersection = r.at(t);
+
+		vec3 p = intersection - Q;
+
+		alpha = dot(w, cross(p,v));
+		beta = dot(w, cross(u, p));
+
+		hit_record uv; //is_interior only writes the uv, shade sets it again for the closest hit
+		return is_interior(alpha, beta, uv);
+	}
 };
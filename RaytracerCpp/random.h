@@ -1,12 +1,68 @@
 #pragma once
 
-//#include <cstdlib>
+#include <cstdint>
+
+// PCG32 (XSH-RR) generator, see https://www.pcg-random.org
+class pcg32 {
+public:
+	pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+	void seed(uint64_t initstate, uint64_t initseq)
+	{
+		state = 0u;
+		inc = (initseq << 1u) | 1u;
+		next_uint();
+		state += initstate;
+		next_uint();
+	}
+
+	uint32_t next_uint()
+	{
+		uint64_t oldstate = state;
+		state = oldstate * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+		uint32_t rot = (uint32_t)(oldstate >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+	}
+
+	//uniform in [0,1)
+	double next_double()
+	{
+		return next_uint() * (1.0 / 4294967296.0);
+	}
+
+private:
+	uint64_t state, inc;
+};
+
+inline uint64_t hash_mix(uint64_t x)
+{
+	//splitmix64 finalizer
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+inline pcg32& thread_rng()
+{
+	static thread_local pcg32 rng;
+	return rng;
+}
+
+// Restarts the calling thread's generator for one pixel sample, so the result depends only on
+// the seed, the pixel and the sample index and not on which thread happens to trace it.
+inline void seed_random(uint64_t seed, uint64_t pixel, uint64_t sample)
+{
+	thread_rng().seed(hash_mix(seed ^ hash_mix(pixel)), hash_mix(sample ^ (seed << 32)));
+}
+
 inline double random_double()
 {
-	return (double)std::rand() / (RAND_MAX + 1);
+	return thread_rng().next_double();
 }
 
 inline double random_double(double min, double max)
 {
 	return min + ((max - min) * random_double());
-}
\ No newline at end of file
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "camera.h"
+#include "boundedqueue.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pixels of a finished tile as linear radiance, on their way from the render workers to the display.
+struct tile_update {
+	tile_rect rect = {};
+	int image_width = 0, image_height = 0;
+	uint64_t generation = 0; //image the tile belongs to, counted up by every start
+	std::vector<float> pixels; //rgb, rect.width * rect.height
+};
+
+// Runs camera::render on a thread of its own so the caller, the UI, never waits for a pass. start() hands
+// over a copy of the camera and the world, the render thread then adds passes until the image has its
+// samples. Workers resolve every tile they finish and push it to a lock-free queue the UI drains with poll().
+// The world must stay unchanged until cancel() or the next start() returned.
+class render_controller {
+public:
+	render_controller() : updates(4096)
+	{
+		worker = std::thread(&render_controller::run, this);
+	}
+
+	~render_controller()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+			cancel_flag = true;
+		}
+		wake.notify_all();
+		worker.join();
+	}
+
+	render_controller(const render_controller&) = delete;
+	render_controller& operator=(const render_controller&) = delete;
+
+	// Starts a new image rendered with a copy of settings, the current one is cancelled first.
+	void start(const camera& settings, const hittable& world)
+	{
+		cancel();
+		std::lock_guard<std::mutex> lock(mutex);
+		cam = std::make_unique<camera>(settings);
+		cam->reset_accumulation();
+		cam->cancel = &cancel_flag;
+		cam->tile_done = [this](const tile_rect& rect) { publish(rect); };
+		scene = &world;
+		generation++;
+		active = true;
+		paused = false;
+		done = false;
+		sample_count = 0;
+		converged = 0;
+		wake.notify_all();
+	}
+
+	// The running pass is finished, no further pass starts until resume().
+	void pause()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		paused = true;
+	}
+
+	void resume()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		paused = false;
+		wake.notify_all();
+	}
+
+	// Stops the image, the running pass skips its remaining tiles. Returns once no pass is running anymore,
+	// the world may be changed from then on.
+	void cancel()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		active = false;
+		cancel_flag = true;
+		wake.wait(lock, [this] { return !in_pass; });
+		cancel_flag = false;
+	}
+
+	bool rendering() const { std::lock_guard<std::mutex> lock(mutex); return active && !paused; }
+	bool is_paused() const { std::lock_guard<std::mutex> lock(mutex); return active && paused; }
+	//no pass is running, inspect() returns without waiting; a pause only gets here once its pass ended
+	bool idle() const { std::lock_guard<std::mutex> lock(mutex); return !in_pass && !(active && !paused); }
+	//the image reached its samples
+	bool finished() const { std::lock_guard<std::mutex> lock(mutex); return done; }
+	uint64_t current_generation() const { std::lock_guard<std::mutex> lock(mutex); return generation; }
+
+	int samples() const { return sample_count.load(std::memory_order_relaxed); }
+	double last_pass_time() const { return pass_seconds.load(std::memory_order_relaxed); }
+	double rays_per_second() const { return ray_rate.load(std::memory_order_relaxed); }
+	double converged_fraction() const { return converged.load(std::memory_order_relaxed); }
+
+	// Next finished tile of the current image, false when none is waiting. update's buffer goes back to the queue.
+	bool poll(tile_update& update)
+	{
+		const uint64_t current = current_generation();
+		while (updates.try_pop(update))
+		{
+			if (update.generation == current)
+				return true;
+		}
+		return false;
+	}
+
+	// Calls f with the camera of the image once no pass is running, e.g. to resolve its outputs. No pass
+	// starts while f runs, false if there is no image. Meant for idle() images, a rendering one moves on
+	// to its next pass without giving the waiting caller a turn.
+	template<typename F>
+	bool inspect(F f)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		wake.wait(lock, [this] { return !in_pass; });
+		if (!cam) return false;
+		f((const camera&)*cam);
+		return true;
+	}
+
+private:
+	mutable std::mutex mutex;
+	std::condition_variable wake;
+	std::thread worker;
+	std::unique_ptr<camera> cam;
+	const hittable* scene = nullptr;
+	uint64_t generation = 0;
+	bool active = false, paused = false, done = false, in_pass = false, quit = false;
+	std::atomic<bool> cancel_flag{ false };
+
+	bounded_queue<tile_update> updates;
+	std::atomic<int> sample_count{ 0 };
+	std::atomic<double> pass_seconds{ 0 }, ray_rate{ 0 }, converged{ 0 };
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			wake.wait(lock, [this] { return quit || (active && !paused); });
+			if (quit) return;
+			if (!cam->needs_samples())
+			{
+				active = false;
+				done = true;
+				continue;
+			}
+
+			in_pass = true;
+			lock.unlock();
+
+			auto start = std::chrono::steady_clock::now();
+			cam->stats->reset();
+			cam->render(*scene);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			lock.lock();
+			in_pass = false;
+			if (!cancel_flag)
+			{
+				sample_count = cam->accumulated_samples();
+				pass_seconds = seconds;
+				if (seconds > 0)
+					ray_rate = cam->stats->total_rays / seconds;
+				converged = cam->converged_fraction();
+			}
+			wake.notify_all();
+		}
+	}
+
+	// Runs on the worker that finished the tile.
+	void publish(const tile_rect& rect)
+	{
+		thread_local tile_update update;
+		update.rect = rect;
+		update.image_width = cam->image_width;
+		update.image_height = cam->image_height;
+		update.generation = generation;
+		update.pixels.resize((size_t)rect.width * rect.height * 3);
+		cam->resolve(rect, update.pixels.data());
+
+		//a full queue means the UI is behind, the worker waits for it instead of dropping the tile
+		while (!updates.try_push(update))
+		{
+			if (cancel_flag.load(std::memory_order_relaxed)) return;
+			std::this_thread::yield();
+		}
+	}
+};
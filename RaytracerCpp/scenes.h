@@ -0,0 +1,176 @@
+#pragma once
+
+#include "general.h"
+#include "hittablelist.h"
+#include "sphere.h"
+#include "camera.h"
+#include "material.h"
+#include "quad.h"
+#include "instance.h"
+#include "triangle.h"
+#include "objimporter.h"
+#include <string>
+
+inline void default_camera(camera& cam)
+{
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 800;
+	cam.samples_per_pixel = 50;
+	cam.max_depth = 5;
+
+	cam.lookfrom = point3(0,1,2);
+	cam.lookat = point3(0, 0, -1);
+	cam.vup = point3(0, 1, 0);
+	cam.vertical_fov = 90;
+	cam.defocus_angle = 0;
+	cam.focus_dist = 1;
+	cam.background = make_shared<image_texture>("photo.jpg");
+	cam.threadsize = 20;
+}
+
+inline void NormalScene(hittable_list& world, camera& cam)
+{
+	//material setup
+	auto mat_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
+	auto mat_red = make_shared<lambertian>(make_shared<image_texture>("photous.jpg"));
+	auto mat_glass = make_shared<dielectric>(1.5);
+	auto mat_chrome = make_shared<metal>(color(0.8, 0.8, 0.8), 0.1);
+	auto mat_gold = make_shared<metal>(color(0.8, 0.6, 0.2), 0.2);
+	auto red = make_shared<diffuse_light>(color(0.5, 0, 0));
+
+	cam.background = make_shared<solid_color>(color(0.5, 0.5, 0.5));
+
+	//world.add(make_shared<sphere>(color(1, 0, -1), 0.5, mat_gold));
+	world.add(make_shared<sphere>(color(0, 0, -1), 0.5, red));
+	/*world.add(make_shared<sphere>(color(-1, 0, -1), 0.5, mat_glass));
+	world.add(make_shared<sphere>(color(-1, 0, -1), -0.4, mat_glass));*/
+	world.add(make_shared<sphere>(color(0, -100.5, -1), 100, mat_ground));
+	//world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 1, 0), vec3(1, 0, 0), red));
+	
+}
+
+inline void NormalScene2(hittable_list& world, camera& cam)
+{
+	//material setup
+	auto mat_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
+	auto mat_red = make_shared<lambertian>(make_shared<image_texture>("photobaba.jpg"));
+	auto mat_baba_light = make_shared<diffuse_light>(make_shared<image_texture>("photobaba.jpg"));
+	auto mat_glass = make_shared<dielectric>(1.5);
+	auto mat_chrome = make_shared<metal>(color(0.8, 0.8, 0.8), 0.1);
+	auto mat_gold = make_shared<metal>(color(0.8, 0.6, 0.2), 0.2);
+	auto red = make_shared<diffuse_light>(color(0.5, 0, 0));
+
+	cam.background = make_shared<solid_color>(color(0.01, 0.01, 0.01));
+
+	world.add(make_shared<sphere>(vec3(1.5, 0, -1), 0.5, mat_gold));
+	auto middle = make_shared<sphere>(vec3(0, 0, 0), 0.5, mat_red);
+	auto baba = make_shared<quad>(vec3(-5, 2, -5),  vec3(10, 0, 0), vec3(0, 5, 0), mat_baba_light);
+
+	world.add(baba);
+	
+	for (int i = 0;i < 100;i++)
+	{
+		//world.add(make_shared<sphere>(vec3(random_double(-10, 10), 0, random_double(-10, 10)), 0.5, mat_red));
+		world.add(make_shared<instance>(middle, vec3(random_double(-10,10),0, random_double(-10, 10)), vec3(0, random_double(0,2*pi), 0)));
+	}	
+	world.add(make_shared<quad>(vec3(-100, -0.5, -100), vec3(0, 0, 200), vec3(200, 0, 0), mat_ground));
+	
+
+	cam.lookfrom = point3(1, 2, 3);
+	cam.lookat = point3(0, 2, -1);
+	cam.samples_per_pixel = 100;
+	cam.max_depth = 20;
+	
+}
+
+inline void Triangle(hittable_list& world, camera& cam) {
+	//auto mat_red = make_shared<lambertian>(make_shared<image_texture>("photobaba.jpg"));
+	
+	/*auto v0 = make_shared<vertex>();
+	auto v1 = make_shared<vertex>();
+	auto v2 = make_shared<vertex>();
+	v0->position = vec3(0, 0, 0);
+	v0->u = 0;
+	v0->v = 0;
+
+	v1->position = vec3(0, 1, 0);
+	v1->u = 0;
+	v1->v = 1;
+
+	v2->position = vec3(1, 0, 0);
+	v2->u = 1;
+	v2->v = 0;
+
+	auto tri = make_shared<triangle>(v0,v1,v2, mat_gold);*/
+	//world.add(tri);
+	auto mat_gold = make_shared<metal>(color(0.8, 0.6, 0.2), 0.2);
+	auto mat_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
+	//auto three_model = make_shared<bvh_node>(*LoadMesh("bidu.obj", mat_gold));	
+	auto whitelight = make_shared<diffuse_light>(color(15, 15, 15));
+
+	auto metildamat = make_shared<lambertian>(make_shared<image_texture>("matilda.jpg"));
+	auto matilda = LoadMesh("matilda.obj", metildamat, &cam.workers());
+	auto light = make_shared<quad>(vec3(0, 0, 0), vec3(0, 1, 0), vec3(0, 0, 0.5), whitelight);
+	
+	world.add( make_shared<instance>(light,vec3(-1,0.5,0),vec3(0, pi / 4,0)));
+	
+	
+	world.add(make_shared<instance>(matilda, vec3(0, -0.5, 0), vec3(0, 0, 0)));
+	
+	/*world.add(make_shared<instance>(matilda, vec3(-1, -0.5, 0), vec3(0, pi / 2, 0)));
+	world.add(make_shared<instance>(matilda, vec3(1, -0.5, -1), vec3(0, pi / 2, 0)));
+	world.add(make_shared<instance>(matilda, vec3(0, -0.5, 1), vec3(0, 0, 0)));*/
+	/*world.add(three_model);
+	world.add( make_shared<instance>(three_model,vec3(1,0,1),vec3(0,pi/2,0)));
+	world.add(make_shared<instance>(three_model, vec3(-1, 0, 1), vec3(0, -pi / 2, 0)));*/
+	
+	world.add(make_shared<quad>(vec3(-100, -0.5, -100), vec3(0, 0, 200), vec3(200, 0, 0), mat_ground));
+	//cam.background = make_shared<solid_color>(vec3(0.5, 0.5, 0.5));
+	//cam.background = make_shared<solid_color>(0.01,0.01,0.05);
+	cam.lookat=vec3(0, 1.2, 0);
+	cam.vertical_fov = 50;
+	cam.image_width = 1920;
+
+}
+
+inline void cornell_box(hittable_list& world, camera& cam) {
+	
+
+	auto red = make_shared<lambertian>(color(.65, .05, .05));
+	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	auto green = make_shared<lambertian>(color(.12, .45, .15));
+	auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+	world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+	world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+	world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+	world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+	world.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+	world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+
+	cam.aspect_ratio = 1.0;
+	cam.image_width = 600;
+	cam.samples_per_pixel = 200;
+	cam.max_depth = 50;
+	cam.background = make_shared<solid_color>(color(0, 0, 0));
+
+	cam.vertical_fov = 40;
+	cam.lookfrom = point3(278, 278, -800);
+	cam.lookat = point3(278, 278, 0);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+
+	
+}
+
+// Scene lookup by name for the command line tools, returns false for an unknown name
+inline bool load_scene(const std::string& name, hittable_list& world, camera& cam)
+{
+	if (name == "normal") NormalScene(world, cam);
+	else if (name == "normal2") NormalScene2(world, cam);
+	else if (name == "cornell") cornell_box(world, cam);
+	else if (name == "triangle") Triangle(world, cam);
+	else return false;
+	return true;
+}
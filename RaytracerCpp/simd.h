@@ -0,0 +1,322 @@
+#pragma once
+
+#include "ray.h"
+#include <cfloat>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACER_SSE 1
+#include <immintrin.h>
+#endif
+
+// Four floats processed together, SSE when available. Comparisons return a bit mask, one bit per lane.
+struct float4 {
+#ifdef RAYTRACER_SSE
+	__m128 v;
+
+	float4() :v(_mm_setzero_ps()) {};
+	float4(float s) :v(_mm_set1_ps(s)) {};
+	float4(__m128 _v) :v(_v) {};
+
+	static float4 load(const float* p) { return float4(_mm_loadu_ps(p)); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+
+	friend float4 operator+(const float4& a, const float4& b) { return _mm_add_ps(a.v, b.v); }
+	friend float4 operator-(const float4& a, const float4& b) { return _mm_sub_ps(a.v, b.v); }
+	friend float4 operator*(const float4& a, const float4& b) { return _mm_mul_ps(a.v, b.v); }
+	friend float4 operator/(const float4& a, const float4& b) { return _mm_div_ps(a.v, b.v); }
+	//the second operand is returned when either is nan
+	friend float4 min(const float4& a, const float4& b) { return _mm_min_ps(a.v, b.v); }
+	friend float4 max(const float4& a, const float4& b) { return _mm_max_ps(a.v, b.v); }
+	friend float4 abs(const float4& a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+	friend float4 sqrt(const float4& a) { return _mm_sqrt_ps(a.v); }
+	//lanes where a < b take if_less, the others otherwise
+	friend float4 select_less(const float4& a, const float4& b, const float4& if_less, const float4& otherwise) {
+		__m128 m = _mm_cmplt_ps(a.v, b.v);
+		return _mm_or_ps(_mm_and_ps(m, if_less.v), _mm_andnot_ps(m, otherwise.v));
+	}
+
+	friend int operator<(const float4& a, const float4& b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+	friend int operator<=(const float4& a, const float4& b) { return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+	friend int operator>(const float4& a, const float4& b) { return _mm_movemask_ps(_mm_cmpgt_ps(a.v, b.v)); }
+	friend int operator>=(const float4& a, const float4& b) { return _mm_movemask_ps(_mm_cmpge_ps(a.v, b.v)); }
+#else
+	float v[4];
+
+	float4() :v{ 0, 0, 0, 0 } {};
+	float4(float s) :v{ s, s, s, s } {};
+
+	static float4 load(const float* p) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = p[i]; return r; }
+	void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+
+	template<typename F>
+	static float4 map(const float4& a, const float4& b, F f) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = f(a.v[i], b.v[i]); return r; }
+	template<typename F>
+	static int test(const float4& a, const float4& b, F f) { int m = 0; for (int i = 0; i < 4; i++) m |= f(a.v[i], b.v[i]) << i; return m; }
+
+	friend float4 operator+(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x + y; }); }
+	friend float4 operator-(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x - y; }); }
+	friend float4 operator*(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x * y; }); }
+	friend float4 operator/(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x / y; }); }
+	friend float4 min(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x < y ? x : y; }); }
+	friend float4 max(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x > y ? x : y; }); }
+	friend float4 abs(const float4& a) { return map(a, a, [](float x, float) { return std::fabs(x); }); }
+	friend float4 sqrt(const float4& a) { return map(a, a, [](float x, float) { return std::sqrt(x); }); }
+	friend float4 select_less(const float4& a, const float4& b, const float4& if_less, const float4& otherwise) {
+		float4 r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] < b.v[i] ? if_less.v[i] : otherwise.v[i]; return r;
+	}
+
+	friend int operator<(const float4& a, const float4& b) { return test(a, b, [](float x, float y) { return x < y; }); }
+	friend int operator<=(const float4& a, const float4& b) { return test(a, b, [](float x, float y) { return x <= y; }); }
+	friend int operator>(const float4& a, const float4& b) { return test(a, b, [](float x, float y) { return x > y; }); }
+	friend int operator>=(const float4& a, const float4& b) { return test(a, b, [](float x, float y) { return x >= y; }); }
+#endif
+};
+
+// Single precision vector for the hot intersection loops, shading still works on vec3.
+struct vec3f {
+	float x, y, z;
+
+	vec3f() :x(0), y(0), z(0) {};
+	vec3f(float _x, float _y, float _z) :x(_x), y(_y), z(_z) {};
+	explicit vec3f(const vec3& v) :x((float)v[0]), y((float)v[1]), z((float)v[2]) {};
+	explicit vec3f(const float* p) :x(p[0]), y(p[1]), z(p[2]) {};
+
+	float operator[](int i) const { return (&x)[i]; }
+};
+
+inline vec3f operator+(const vec3f& a, const vec3f& b) { return vec3f(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline vec3f operator-(const vec3f& a, const vec3f& b) { return vec3f(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline vec3f operator*(float s, const vec3f& a) { return vec3f(s * a.x, s * a.y, s * a.z); }
+
+inline float dot(const vec3f& a, const vec3f& b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline vec3f cross(const vec3f& a, const vec3f& b)
+{
+	return vec3f(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+// Float copy of a ray for BVH traversal. The reciprocal direction and its signs are computed once per ray
+// instead of once per node.
+struct alignas(16) traversal_ray {
+	float origin[4];
+	float direction[4];
+	float inv_dir[4];
+	int sign[3]; //1 where the direction is negative, a child's far side then is its min plane
+
+	traversal_ray(const ray& r)
+	{
+		auto o = r.origin();
+		auto d = r.direction();
+		for (int a = 0; a < 3; a++)
+		{
+			origin[a] = (float)o[a];
+			direction[a] = (float)d[a];
+			inv_dir[a] = 1.0f / direction[a];
+			sign[a] = inv_dir[a] < 0;
+		}
+		origin[3] = direction[3] = inv_dir[3] = 0;
+	}
+
+	vec3f orig() const { return vec3f(origin); }
+	vec3f dir() const { return vec3f(direction); }
+
+	// Slab test against a box given as 16 byte aligned bmin and bmax rows, only xyz of each row is read.
+	// Returns the entry distance, or infinity when the box is missed inside [tmin, tmax].
+	float intersect_box(const float* bmin, const float* bmax, float tmin, float tmax) const
+	{
+#ifdef RAYTRACER_SSE
+		//the 4th lane of a node row holds an index, it is masked out so it can never be a nan or a denormal
+		const __m128 xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+		const __m128 o = _mm_load_ps(origin);
+		const __m128 inv = _mm_load_ps(inv_dir);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_and_ps(_mm_load_ps(bmin), xyz), o), inv);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_and_ps(_mm_load_ps(bmax), xyz), o), inv);
+		__m128 tnear = _mm_min_ps(t0, t1);
+		__m128 tfar = _mm_max_ps(t0, t1);
+
+		__m128 enter = _mm_max_ss(_mm_max_ss(tnear, _mm_shuffle_ps(tnear, tnear, _MM_SHUFFLE(1, 1, 1, 1))),
+			_mm_max_ss(_mm_shuffle_ps(tnear, tnear, _MM_SHUFFLE(2, 2, 2, 2)), _mm_set_ss(tmin)));
+		__m128 exit = _mm_min_ss(_mm_min_ss(tfar, _mm_shuffle_ps(tfar, tfar, _MM_SHUFFLE(1, 1, 1, 1))),
+			_mm_min_ss(_mm_shuffle_ps(tfar, tfar, _MM_SHUFFLE(2, 2, 2, 2)), _mm_set_ss(tmax)));
+
+		float t_enter = _mm_cvtss_f32(enter);
+		return t_enter <= _mm_cvtss_f32(exit) ? t_enter : std::numeric_limits<float>::infinity();
+#else
+		for (int a = 0; a < 3; a++)
+		{
+			const float* near_plane = sign[a] ? bmax : bmin;
+			const float* far_plane = sign[a] ? bmin : bmax;
+			float t0 = (near_plane[a] - origin[a]) * inv_dir[a];
+			float t1 = (far_plane[a] - origin[a]) * inv_dir[a];
+			tmin = t0 > tmin ? t0 : tmin;
+			tmax = t1 < tmax ? t1 : tmax;
+		}
+		return tmin <= tmax ? tmin : std::numeric_limits<float>::infinity();
+#endif
+	}
+
+	// Slab test against 4 boxes stored as structure of arrays: lower[axis * stride + box], same for upper.
+	// Empty slots hold lower = +inf and upper = -inf and are always missed.
+	// Writes the entry distances and returns a bit mask of the boxes that were hit.
+	int intersect_box4(const float* lower, const float* upper, int stride, float tmin, float tmax, float* dist) const
+	{
+#ifdef RAYTRACER_SSE
+		__m128 t_enter = _mm_set1_ps(tmin);
+		__m128 t_exit = _mm_set1_ps(tmax);
+		for (int a = 0; a < 3; a++)
+		{
+			//the near plane is picked by the direction's sign, so no min/max is needed per axis
+			const float* near_plane = (sign[a] ? upper : lower) + a * stride;
+			const float* far_plane = (sign[a] ? lower : upper) + a * stride;
+			const __m128 o = _mm_set1_ps(origin[a]);
+			const __m128 inv = _mm_set1_ps(inv_dir[a]);
+			//a nan from 0 * inf is dropped by max/min taking their second operand
+			t_enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_plane), o), inv), t_enter);
+			t_exit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_plane), o), inv), t_exit);
+		}
+		_mm_storeu_ps(dist, t_enter);
+		return _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit));
+#else
+		int mask = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			float t_enter = tmin, t_exit = tmax;
+			for (int a = 0; a < 3; a++)
+			{
+				const float* near_plane = (sign[a] ? upper : lower) + a * stride;
+				const float* far_plane = (sign[a] ? lower : upper) + a * stride;
+				float t0 = (near_plane[i] - origin[a]) * inv_dir[a];
+				float t1 = (far_plane[i] - origin[a]) * inv_dir[a];
+				t_enter = t0 > t_enter ? t0 : t_enter;
+				t_exit = t1 < t_exit ? t1 : t_exit;
+			}
+			dist[i] = t_enter;
+			mask |= (t_enter <= t_exit) << i;
+		}
+		return mask;
+#endif
+	}
+
+	// Same as intersect_box4 for 8 boxes, one AVX pass when the build enables AVX.
+	int intersect_box8(const float* lower, const float* upper, int stride, float tmin, float tmax, float* dist) const
+	{
+#ifdef __AVX__
+		__m256 t_enter = _mm256_set1_ps(tmin);
+		__m256 t_exit = _mm256_set1_ps(tmax);
+		for (int a = 0; a < 3; a++)
+		{
+			const float* near_plane = (sign[a] ? upper : lower) + a * stride;
+			const float* far_plane = (sign[a] ? lower : upper) + a * stride;
+			const __m256 o = _mm256_set1_ps(origin[a]);
+			const __m256 inv = _mm256_set1_ps(inv_dir[a]);
+			t_enter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_plane), o), inv), t_enter);
+			t_exit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_plane), o), inv), t_exit);
+		}
+		_mm256_storeu_ps(dist, t_enter);
+		return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+#else
+		int low = intersect_box4(lower, upper, stride, tmin, tmax, dist);
+		int high = intersect_box4(lower + 4, upper + 4, stride, tmin, tmax, dist + 4);
+		return low | (high << 4);
+#endif
+	}
+};
+
+// A float that is not below d, so a float interval never cuts off part of the double one.
+inline float float_above(double d)
+{
+	float f = (float)d;
+	if ((double)f < d)
+		f += fabsf(f) * FLT_EPSILON + FLT_MIN; //at least one ulp up
+	return f;
+}
+
+// Up to 8 coherent rays, e.g. camera rays of neighbouring pixels, traced together so every BVH node
+// that is fetched is tested against the whole packet. Lanes are addressed by bit masks.
+struct alignas(32) ray_packet {
+	static const int size = 8;
+
+	const ray* rays; //the exact rays, hit records are always filled in double from these
+	int count = 0;
+	double tmin = 0;
+	double tmax[size]; //closest hit so far per lane
+
+	float ox[size], oy[size], oz[size];
+	float dx[size], dy[size], dz[size];
+	float ix[size], iy[size], iz[size];
+	float tmin_f = 0;
+	float tmax_f[size]; //tmax rounded up, for the float tests
+
+	ray_packet(const ray* _rays, int _count, double _tmin, double _tmax) :rays(_rays), count(_count), tmin(_tmin)
+	{
+		tmin_f = -float_above(-tmin);
+		for (int i = 0; i < size; i++)
+		{
+			//unused lanes repeat the first ray so they never produce nan or denormals
+			const ray& r = rays[i < count ? i : 0];
+			auto o = r.origin();
+			auto d = r.direction();
+			ox[i] = (float)o[0]; oy[i] = (float)o[1]; oz[i] = (float)o[2];
+			dx[i] = (float)d[0]; dy[i] = (float)d[1]; dz[i] = (float)d[2];
+			ix[i] = 1.0f / dx[i]; iy[i] = 1.0f / dy[i]; iz[i] = 1.0f / dz[i];
+			set_tmax(i, _tmax);
+		}
+	}
+
+	int all() const { return (1 << count) - 1; }
+
+	void set_tmax(int lane, double t)
+	{
+		tmax[lane] = t;
+		tmax_f[lane] = float_above(t);
+	}
+
+	// Lanes of mask whose tmax is not in front of dist.
+	int reaching(int mask, float dist) const
+	{
+		int result = 0;
+		for (int i = 0; i < size; i++)
+		{
+			if ((mask >> i) & 1 && dist <= tmax_f[i])
+				result |= 1 << i;
+		}
+		return result;
+	}
+
+	// Slab test of every lane in mask against one box, returns the lanes that hit it
+	// and the smallest entry distance among them in nearest.
+	int intersect_box(const float* bmin, const float* bmax, int mask, float& nearest) const
+	{
+		int hits = 0;
+		nearest = std::numeric_limits<float>::infinity();
+		for (int h = 0; h < size; h += 4)
+		{
+			if (!((mask >> h) & 0xF)) continue;
+			const float4 tx0 = (float4(bmin[0]) - float4::load(ox + h)) * float4::load(ix + h);
+			const float4 tx1 = (float4(bmax[0]) - float4::load(ox + h)) * float4::load(ix + h);
+			const float4 ty0 = (float4(bmin[1]) - float4::load(oy + h)) * float4::load(iy + h);
+			const float4 ty1 = (float4(bmax[1]) - float4::load(oy + h)) * float4::load(iy + h);
+			const float4 tz0 = (float4(bmin[2]) - float4::load(oz + h)) * float4::load(iz + h);
+			const float4 tz1 = (float4(bmax[2]) - float4::load(oz + h)) * float4::load(iz + h);
+			const float4 t_enter = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), float4(tmin_f)));
+			const float4 t_exit = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), float4::load(tmax_f + h)));
+
+			int half = (t_enter <= t_exit) & (mask >> h) & 0xF;
+			if (!half) continue;
+			hits |= half << h;
+			alignas(16) float enter[4];
+			t_enter.store(enter);
+			for (int i = 0; i < 4; i++)
+			{
+				if ((half >> i) & 1 && enter[i] < nearest)
+					nearest = enter[i];
+			}
+		}
+		return hits;
+	}
+};
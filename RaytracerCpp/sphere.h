@@ -1,5 +1,7 @@
 #pragma once
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
 #include "vec3.h"
 
 class sphere : public hittable {
@@ -10,7 +12,105 @@ public:
 	};
 
 	
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override{
+	bool intersect(const ray& r, interval ray_t, hit_record& rec) const override{
+		double root;
+		if (!nearest_root(r, ray_t, root))
+			return false;
+		rec.set_hit(root, this);
+		return true;
+	}
+
+	void shade(const ray& r, hit_record& rec) const override {
+		rec.p = r.at(rec.t);
+		vec3 out_normal = (rec.p - center) * (1/radius);
+		rec.set_face_normal(r, out_normal);
+		get_sphere_uv(out_normal, rec.u, rec.v);
+		rec.mat = mat.get();
+	}
+
+	bool occluded(const ray& r, interval ray_t) const override {
+		double root;
+		return nearest_root(r, ray_t, root);
+	}
+
+	int hit_packet(ray_packet& packet, int mask, hit_record* recs) const override {
+		//a float test with some slack rejects the lanes that clearly miss, the others run the exact test
+		const float4 cx((float)center[0]), cy((float)center[1]), cz((float)center[2]);
+		const float4 r2((float)(radius * radius));
+		int candidates = 0;
+		for (int h = 0; h < ray_packet::size; h += 4)
+		{
+			if (!((mask >> h) & 0xF)) continue;
+			const float4 dx = float4::load(packet.dx + h), dy = float4::load(packet.dy + h), dz = float4::load(packet.dz + h);
+			const float4 ox = float4::load(packet.ox + h) - cx, oy = float4::load(packet.oy + h) - cy, oz = float4::load(packet.oz + h) - cz;
+			const float4 a = dx * dx + dy * dy + dz * dz;
+			const float4 b = dx * ox + dy * oy + dz * oz;
+			const float4 c = ox * ox + oy * oy + oz * oz - r2;
+			const float4 discriminant = b * b - a * c;
+			candidates |= ((discriminant >= float4(-1e-3f) * (b * b + abs(a * c))) & (mask >> h) & 0xF) << h;
+		}
+
+		int hits = 0;
+		for (int i = 0; i < packet.count; i++)
+		{
+			if ((candidates >> i) & 1 && intersect(packet.rays[i], interval(packet.tmin, packet.tmax[i]), recs[i]))
+			{
+				packet.set_tmax(i, recs[i].t);
+				hits |= 1 << i;
+			}
+		}
+		return hits;
+	}
+
+	aabb bounding_box() const override {
+		return bbox;
+	}
+
+	void collect_lights(std::vector<const hittable*>& lights) const override {
+		if (mat->is_emissive())
+			lights.push_back(this);
+	}
+
+	//uniform over the cone the sphere covers as seen from origin
+	double pdf_value(const point3& origin, const vec3& direction) const override {
+		auto distance_squared = (center - origin).length_squared();
+		if (distance_squared <= radius * radius)
+			return 0;
+
+		hit_record rec;
+		if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+			return 0;
+
+		auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+		auto solid_angle = 2 * pi * (1 - cos_theta_max);
+		return 1 / solid_angle;
+	}
+
+	vec3 random(const point3& origin) const override {
+		vec3 direction = center - origin;
+		auto distance_squared = direction.length_squared();
+		if (distance_squared <= radius * radius)
+			return random_unit_vector();
+
+		auto r1 = random_double();
+		auto r2 = random_double();
+		auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+		auto phi = 2 * pi * r1;
+		auto x = cos(phi) * sqrt(1 - z * z);
+		auto y = sin(phi) * sqrt(1 - z * z);
+
+		return onb(direction).transform(vec3(x, y, z));
+	}
+
+private:
+	point3 center;
+	double radius;
+	shared_ptr<material> mat;
+	aabb bbox;
+
+	//nearest root of the ray inside ray_t
+	bool nearest_root(const ray& r, const interval& ray_t, double& root) const
+	{
 		auto A_minus_C = r.origin() - center;
 		auto a = r.direction().length_squared();
 		auto b = dot(r.direction(), A_minus_C);
@@ -21,7 +121,7 @@ public:
 		if (determinant < 0)
 			return false;
 		auto sqrtd = sqrt(determinant);
-		auto root = (-b - sqrtd) / a;
+		root = (-b - sqrtd) / a;
 		if (!ray_t.sorrounds(root))
 		{
 			root = (-b + sqrtd) / a;
@@ -30,26 +130,9 @@ public:
 				return false;
 			}
 		}
-		rec.t = root;
-		rec.p = r.at(root);
-		vec3 out_normal = (rec.p - center) * (1/radius);
-		rec.set_face_normal(r, out_normal);
-		get_sphere_uv(out_normal, rec.u, rec.v);
-		rec.mat = mat;
-
 		return true;
 	}
 
-	aabb bounding_box() const override {
-		return bbox;
-	}
-
-private:
-	point3 center;
-	double radius;
-	shared_ptr<material> mat;
-	aabb bbox;
-
 	static void get_sphere_uv(const point3& p, double& u, double& v)
 	{
 		auto theta = acos(-p.y());
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of workers, each owning a deque of tasks.
+// A worker pops from the back of its own deque and steals from the front of the others when it runs dry,
+// so contention is limited to a short per-queue lock instead of one global lock.
+class thread_pool {
+public:
+	explicit thread_pool(int threadcount) {
+		threadcount = threadcount < 1 ? 1 : threadcount;
+		for (int i = 0; i < threadcount; i++)
+		{
+			queues.push_back(std::make_unique<worker_queue>());
+		}
+		for (int i = 0; i < threadcount; i++)
+		{
+			workers.push_back(std::thread(&thread_pool::worker_loop, this, i));
+		}
+	}
+
+	~thread_pool() {
+		{
+			std::lock_guard<std::mutex> lock(sleep_mtx);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& th : workers)
+		{
+			th.join();
+		}
+	}
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	int size() const { return (int)workers.size(); }
+
+	// Tasks submitted from inside a worker go to that worker's own deque, others are dealt round robin.
+	void submit(std::function<void()> task) {
+		int index = current_worker() >= 0 ? current_worker() : (int)(next_queue++ % queues.size());
+		{
+			std::lock_guard<std::mutex> lock(queues[index]->mtx);
+			queues[index]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleep_mtx);
+			pending++;
+		}
+		wake.notify_one();
+	}
+
+	// Runs one queued task on the calling thread, returns false if there was nothing to do.
+	bool run_pending_task() {
+		std::function<void()> task;
+		if (!take_task(current_worker(), task))
+			return false;
+		task();
+		return true;
+	}
+
+private:
+	struct worker_queue {
+		std::mutex mtx;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<worker_queue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<unsigned int> next_queue{ 0 };
+	std::atomic<int> pending{ 0 };
+
+	std::mutex sleep_mtx;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	struct worker_id {
+		const thread_pool* pool = nullptr;
+		int index = -1;
+	};
+
+	static worker_id& this_worker() {
+		static thread_local worker_id id;
+		return id;
+	}
+
+	int current_worker() const {
+		return this_worker().pool == this ? this_worker().index : -1;
+	}
+
+	bool take_task(int self, std::function<void()>& task) {
+		if (pending.load() <= 0)
+			return false;
+
+		int count = (int)queues.size();
+		if (self >= 0)
+		{
+			auto& own = *queues[self];
+			std::lock_guard<std::mutex> lock(own.mtx);
+			if (!own.tasks.empty())
+			{
+				task = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				pending--;
+				return true;
+			}
+		}
+
+		int start = self >= 0 ? self + 1 : 0;
+		for (int i = 0; i < count; i++)
+		{
+			auto& victim = *queues[(start + i) % count];
+			std::lock_guard<std::mutex> lock(victim.mtx);
+			if (!victim.tasks.empty())
+			{
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				pending--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void worker_loop(int index) {
+		this_worker().pool = this;
+		this_worker().index = index;
+		std::function<void()> task;
+		while (true)
+		{
+			if (take_task(index, task))
+			{
+				task();
+				task = nullptr;
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(sleep_mtx);
+			wake.wait(lock, [this] { return stopping || pending.load() > 0; });
+			if (stopping && pending.load() <= 0)
+				return;
+		}
+	}
+};
+
+// Tracks a batch of tasks on a pool; wait() helps run queued work until the whole batch is done,
+// which also makes it safe to wait on a group from inside another task.
+class task_group {
+public:
+	explicit task_group(thread_pool& _pool) :pool(_pool) {};
+
+	~task_group() {
+		wait();
+	}
+
+	template<typename F>
+	void run(F&& fn) {
+		remaining++;
+		pool.submit([this, fn = std::forward<F>(fn)]() mutable {
+			fn();
+			remaining--;
+		});
+	}
+
+	void wait() {
+		while (remaining.load() > 0)
+		{
+			if (!pool.run_pending_task())
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	thread_pool& pool;
+	std::atomic<int> remaining{ 0 };
+};
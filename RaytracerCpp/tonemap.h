@@ -0,0 +1,97 @@
+#pragma once
+
+#include "simd.h"
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Display transform of linear radiance, applied once to the resolved image instead of to every sample.
+enum class tonemap_operator { clamp, reinhard, aces };
+
+inline const char* tonemap_operator_name(tonemap_operator op)
+{
+	switch (op)
+	{
+	case tonemap_operator::reinhard: return "reinhard";
+	case tonemap_operator::aces: return "aces";
+	default: return "clamp";
+	}
+}
+
+inline bool parse_tonemap_operator(const std::string& name, tonemap_operator& op)
+{
+	if (name == "clamp" || name == "none") op = tonemap_operator::clamp;
+	else if (name == "reinhard") op = tonemap_operator::reinhard;
+	else if (name == "aces") op = tonemap_operator::aces;
+	else return false;
+	return true;
+}
+
+struct tonemap_settings {
+	float exposure = 0; //stops, the radiance is scaled by 2^exposure first
+	tonemap_operator op = tonemap_operator::clamp;
+	bool srgb = true; //encode for display, off leaves the mapped values linear
+};
+
+// Linear to sRGB of values in [0,1]. The power segment is a fit on three square roots, within 0.001 of the exact
+// curve, which is at most one step apart once quantized to 8 bits.
+inline float4 linear_to_srgb(const float4& x)
+{
+	float4 s1 = sqrt(x);
+	float4 s2 = sqrt(s1);
+	float4 s3 = sqrt(s2);
+	float4 curve = float4(0.662002687f) * s1 + float4(0.684122060f) * s2 - float4(0.323583601f) * s3 - float4(0.0225411470f) * x;
+	return select_less(x, float4(0.0031308f), float4(12.92f) * x, curve);
+}
+
+inline float4 tonemap(const float4& radiance, const tonemap_settings& settings, const float4& scale)
+{
+	float4 x = max(radiance * scale, float4(0.0f)); //also drops nans
+	if (settings.op == tonemap_operator::reinhard)
+		x = x / (x + float4(1.0f));
+	else if (settings.op == tonemap_operator::aces)
+		x = (x * (float4(2.51f) * x + float4(0.03f))) / (x * (float4(2.43f) * x + float4(0.59f)) + float4(0.14f)); //Narkowicz's fit of the ACES curve
+	x = min(x, float4(1.0f));
+	return settings.srgb ? linear_to_srgb(x) : x;
+}
+
+// Maps count floats of linear radiance to display values in [0,1]. Every channel is mapped on its own,
+// so interleaved rgb and single planes both work, in and out may be the same.
+inline void tonemap(const float* in, float* out, size_t count, const tonemap_settings& settings)
+{
+	const float4 scale(std::exp2(settings.exposure));
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		tonemap(float4::load(in + i), settings, scale).store(out + i);
+	}
+	if (i < count)
+	{
+		float tail[4] = {};
+		for (size_t k = i; k < count; k++) tail[k - i] = in[k];
+		tonemap(float4::load(tail), settings, scale).store(tail);
+		for (size_t k = i; k < count; k++) out[k] = tail[k - i];
+	}
+}
+
+// Display values to 8 bits, clamped and rounded to nearest.
+inline void quantize(const float* in, uint8_t* out, size_t count)
+{
+	size_t i = 0;
+#ifdef RAYTRACER_SSE
+	const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(255.0f);
+	auto lane = [&](size_t k) { return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + k), hi), lo), hi)); };
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i low = _mm_packs_epi32(lane(i), lane(i + 4));
+		__m128i high = _mm_packs_epi32(lane(i + 8), lane(i + 12));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		float v = in[i] * 255.0f + 0.5f;
+		out[i] = (uint8_t)(v > 0 ? (v < 255.0f ? v : 255.0f) : 0.0f);
+	}
+}
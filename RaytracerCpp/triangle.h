@@ -28,34 +28,19 @@ public:
 		normal = cross(vertices[1]->position - vertices[0]->position, vertices[2]->position - vertices[0]->position);
 	}
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {	
-		
-		auto ndotd = dot(normal, r.direction());
-
-		if (fabs(ndotd) < 1e-8)
-			return false;		
-
-		auto u = v1 - v0;
-		auto v = v2 - v0;
-		auto rov0 = r.origin() - v0;
-				
-		auto d = 1 / ndotd;
-		auto t = d * dot(-normal, rov0);
-
-		if (!ray_t.contains(t))
+	bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {	
+		double t, alpha, beta;
+		if (!barycentric_hit(r, ray_t, t, alpha, beta))
 			return false;
 
-		auto q = cross(rov0, r.direction());
-		auto alpha = d * dot(-q, v);
-		auto beta = d * dot(q, u);
-		
-		if (alpha < 0.0 || beta < 0.0 || (alpha + beta)>1.0) return false;
-
-		auto intersection = r.at(t);
+		rec.set_hit(t, this, 0, alpha, beta);
+		return true;
+	}
 
-		rec.t = t;
-		rec.p = intersection;
-		rec.mat = mat;
+	void shade(const ray& r, hit_record& rec) const override {
+		const double alpha = rec.bu, beta = rec.bv;
+		rec.p = r.at(rec.t);
+		rec.mat = mat.get();
 
 		auto w = 1 - alpha - beta;
 
@@ -68,8 +53,11 @@ public:
 		}
 		else
 			rec.set_face_normal(r, normal);
-		
-		return true;
+	}
+
+	bool occluded(const ray& r, interval ray_t) const override {
+		double t, alpha, beta;
+		return barycentric_hit(r, ray_t, t, alpha, beta);
 	}
 
 	aabb bounding_box() const override {
@@ -84,4 +72,27 @@ private:
 	shared_ptr<vertex> vertices[3];	
 	shared_ptr<material> mat;
 	aabb bbox;
+
+	bool barycentric_hit(const ray& r, const interval& ray_t, double& t, double& alpha, double& beta) const {
+		auto ndotd = dot(normal, r.direction());
+
+		if (fabs(ndotd) < 1e-8)
+			return false;		
+
+		auto u = v1 - v0;
+		auto v = v2 - v0;
+		auto rov0 = r.origin() - v0;
+				
+		auto d = 1 / ndotd;
+		t = d * dot(-normal, rov0);
+
+		if (!ray_t.contains(t))
+			return false;
+
+		auto q = cross(rov0, r.direction());
+		alpha = d * dot(-q, v);
+		beta = d * dot(q, u);
+		
+		return !(alpha < 0.0 || beta < 0.0 || (alpha + beta)>1.0);
+	}
 };
\ No newline at end of file
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "general.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "simd.h"
+#include <cstdint>
+
+// Indexed triangle mesh with shared vertex buffers. Triangles are only referenced by index,
+// from the index buffer and from the leaves of the mesh's own BVH.
+class triangle_mesh : public hittable {
+public:
+	std::vector<float> positions; //xyz per vertex
+	std::vector<float> normals; //xyz per vertex, empty for flat shading
+	std::vector<float> uvs; //uv per vertex, may be empty
+	std::vector<uint32_t> indices; //three per triangle
+	bool smooth = true;
+
+	triangle_mesh(shared_ptr<material> m) :mat(m) {};
+
+	size_t vertex_count() const { return positions.size() / 3; }
+	size_t triangle_count() const { return indices.size() / 3; }
+
+	uint32_t add_vertex(const vec3& position, double u, double v, const vec3& normal)
+	{
+		positions.insert(positions.end(), { (float)position[0], (float)position[1], (float)position[2] });
+		uvs.insert(uvs.end(), { (float)u, (float)v });
+		normals.insert(normals.end(), { (float)normal[0], (float)normal[1], (float)normal[2] });
+		return (uint32_t)(vertex_count() - 1);
+	}
+
+	void add_triangle(uint32_t a, uint32_t b, uint32_t c)
+	{
+		indices.insert(indices.end(), { a, b, c });
+	}
+
+	// Builds the BVH and reorders the index buffer so leaves cover contiguous triangles.
+	void build(thread_pool* pool = nullptr)
+	{
+		std::vector<aabb> bounds(triangle_count());
+		for (size_t i = 0; i < bounds.size(); i++)
+		{
+			auto v0 = position(indices[i * 3]);
+			auto v1 = position(indices[i * 3 + 1]);
+			auto v2 = position(indices[i * 3 + 2]);
+			bounds[i] = aabb(aabb(v0, v1), aabb(v2, v2)).pad();
+		}
+		tree.build(bounds, pool);
+
+		std::vector<uint32_t> sorted(indices.size());
+		for (size_t i = 0; i < tree.indices.size(); i++)
+		{
+			auto tri = tree.indices[i];
+			sorted[i * 3] = indices[tri * 3];
+			sorted[i * 3 + 1] = indices[tri * 3 + 1];
+			sorted[i * 3 + 2] = indices[tri * 3 + 2];
+			tree.indices[i] = (uint32_t)i;
+		}
+		indices.swap(sorted);
+		bbox = tree.bounding_box();
+	}
+
+	double build_time() const {
+		return tree.build_seconds;
+	}
+
+	// The mesh's BVH, so a mesh cache can store it and fill it back in without a rebuild.
+	bvh_tree& bvh() { return tree; }
+	const bvh_tree& bvh() const { return tree; }
+
+	// Instead of build(), after the buffers and bvh() were filled from a cache.
+	void restored()
+	{
+		bbox = tree.bounding_box();
+	}
+
+	bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+		traversal_ray fr(r);
+		const vec3f orig = fr.orig(), dir = fr.dir();
+		return tree.traverse(fr, ray_t, [&](uint32_t tri, interval& t) {
+			if (!hit_triangle(orig, dir, t, tri, rec))
+				return false;
+			t.max = rec.t;
+			return true;
+		});
+	}
+
+	// Interpolates the uv and normal of the closest triangle from its barycentrics, in double.
+	void shade(const ray& r, hit_record& rec) const override {
+		const uint32_t tri = rec.primitive;
+		const uint32_t i0 = indices[tri * 3], i1 = indices[tri * 3 + 1], i2 = indices[tri * 3 + 2];
+		const float alpha = (float)rec.bu, beta = (float)rec.bv;
+		rec.p = r.at(rec.t);
+		rec.mat = mat.get();
+
+		auto w = 1 - alpha - beta;
+		if (!uvs.empty())
+		{
+			rec.u = w * uvs[i0 * 2] + alpha * uvs[i1 * 2] + beta * uvs[i2 * 2];
+			rec.v = w * uvs[i0 * 2 + 1] + alpha * uvs[i1 * 2 + 1] + beta * uvs[i2 * 2 + 1];
+		}
+		else
+		{
+			rec.u = alpha;
+			rec.v = beta;
+		}
+
+		if (smooth && !normals.empty())
+			rec.set_face_normal(r, unit_vector(w * normal(i0) + alpha * normal(i1) + beta * normal(i2)));
+		else
+		{
+			const vec3f v0(&positions[i0 * 3]);
+			const vec3f e1 = vec3f(&positions[i1 * 3]) - v0;
+			const vec3f e2 = vec3f(&positions[i2 * 3]) - v0;
+			auto face_normal = cross(vec3(e1.x, e1.y, e1.z), vec3(e2.x, e2.y, e2.z));
+			rec.set_face_normal(r, unit_vector(face_normal));
+		}
+	}
+
+	bool occluded(const ray& r, interval ray_t) const override {
+		traversal_ray fr(r);
+		const vec3f orig = fr.orig(), dir = fr.dir();
+		return tree.occluded(fr, ray_t, [&](uint32_t tri, interval& t) {
+			double distance;
+			float alpha, beta;
+			return intersect_triangle(orig, dir, t, tri, distance, alpha, beta);
+		});
+	}
+
+	int hit_packet(ray_packet& packet, int mask, hit_record* recs) const override {
+		return tree.traverse_packet(packet, mask, [&](uint32_t tri, int lanes) {
+			//the packet test only finds candidates, the scalar test then records the hit of each lane
+			int hits = 0;
+			for (int candidates = hit_triangle_packet(packet, lanes, tri); candidates; candidates &= candidates - 1)
+			{
+				int i = 0;
+				while (!((candidates >> i) & 1)) i++;
+				vec3f orig(packet.ox[i], packet.oy[i], packet.oz[i]);
+				vec3f dir(packet.dx[i], packet.dy[i], packet.dz[i]);
+				if (hit_triangle(orig, dir, interval(packet.tmin, packet.tmax[i]), tri, recs[i]))
+				{
+					packet.set_tmax(i, recs[i].t);
+					hits |= 1 << i;
+				}
+			}
+			return hits;
+		});
+	}
+
+	aabb bounding_box() const override {
+		return bbox;
+	}
+
+private:
+	shared_ptr<material> mat;
+	bvh_tree tree;
+	aabb bbox;
+
+	vec3 position(uint32_t vertex) const {
+		const float* p = &positions[vertex * 3];
+		return vec3(p[0], p[1], p[2]);
+	}
+
+	vec3 normal(uint32_t vertex) const {
+		const float* n = &normals[vertex * 3];
+		return vec3(n[0], n[1], n[2]);
+	}
+
+	// Moller-Trumbore in single precision on the float vertex buffer.
+	bool intersect_triangle(const vec3f& orig, const vec3f& dir, const interval& ray_t, uint32_t tri, double& t, float& alpha, float& beta) const
+	{
+		const vec3f v0(&positions[indices[tri * 3] * 3]);
+		const vec3f e1 = vec3f(&positions[indices[tri * 3 + 1] * 3]) - v0;
+		const vec3f e2 = vec3f(&positions[indices[tri * 3 + 2] * 3]) - v0;
+
+		const vec3f p = cross(dir, e2);
+		const float det = dot(e1, p);
+		if (fabsf(det) < 1e-12f)
+			return false;
+
+		const float inv_det = 1.0f / det;
+		const vec3f s = orig - v0;
+		alpha = dot(s, p) * inv_det;
+		if (alpha < 0.0f || alpha > 1.0f)
+			return false;
+
+		const vec3f q = cross(s, e1);
+		beta = dot(dir, q) * inv_det;
+		if (beta < 0.0f || alpha + beta > 1.0f)
+			return false;
+
+		t = dot(e2, q) * inv_det;
+		return ray_t.contains(t);
+	}
+
+	bool hit_triangle(const vec3f& orig, const vec3f& dir, const interval& ray_t, uint32_t tri, hit_record& rec) const
+	{
+		double t;
+		float alpha, beta;
+		if (!intersect_triangle(orig, dir, ray_t, tri, t, alpha, beta))
+			return false;
+		rec.set_hit(t, this, tri, alpha, beta);
+		return true;
+	}
+
+	// The same test as hit_triangle for the lanes of a packet, four at a time and in the same order of
+	// operations, so a lane is a candidate exactly when the scalar test would accept it.
+	int hit_triangle_packet(const ray_packet& packet, int mask, uint32_t tri) const
+	{
+		const float* p0 = &positions[indices[tri * 3] * 3];
+		const float* p1 = &positions[indices[tri * 3 + 1] * 3];
+		const float* p2 = &positions[indices[tri * 3 + 2] * 3];
+		const float4 e1x(p1[0] - p0[0]), e1y(p1[1] - p0[1]), e1z(p1[2] - p0[2]);
+		const float4 e2x(p2[0] - p0[0]), e2y(p2[1] - p0[1]), e2z(p2[2] - p0[2]);
+
+		int candidates = 0;
+		for (int h = 0; h < ray_packet::size; h += 4)
+		{
+			int lanes = (mask >> h) & 0xF;
+			if (!lanes) continue;
+
+			const float4 dx = float4::load(packet.dx + h), dy = float4::load(packet.dy + h), dz = float4::load(packet.dz + h);
+			const float4 px = dy * e2z - dz * e2y;
+			const float4 py = dz * e2x - dx * e2z;
+			const float4 pz = dx * e2y - dy * e2x;
+			const float4 det = e1x * px + e1y * py + e1z * pz;
+			lanes &= abs(det) >= float4(1e-12f);
+
+			const float4 inv_det = float4(1.0f) / det;
+			const float4 sx = float4::load(packet.ox + h) - float4(p0[0]);
+			const float4 sy = float4::load(packet.oy + h) - float4(p0[1]);
+			const float4 sz = float4::load(packet.oz + h) - float4(p0[2]);
+			const float4 alpha = (sx * px + sy * py + sz * pz) * inv_det;
+			lanes &= (alpha >= float4(0.0f)) & (alpha <= float4(1.0f));
+
+			const float4 qx = sy * e1z - sz * e1y;
+			const float4 qy = sz * e1x - sx * e1z;
+			const float4 qz = sx * e1y - sy * e1x;
+			const float4 beta = (dx * qx + dy * qy + dz * qz) * inv_det;
+			lanes &= (beta >= float4(0.0f)) & (alpha + beta <= float4(1.0f));
+
+			const float4 t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+			lanes &= (t >= float4(packet.tmin_f)) & (t <= float4::load(packet.tmax_f + h));
+			candidates |= lanes << h;
+		}
+		return candidates;
+	}
+};
@@ -0,0 +1,241 @@
+// Command line renderer without any window or GL context, for render nodes without a display.
+// Loads one of the built-in scenes, renders it with camera::render and writes the image.
+
+#include "general.h"
+#include "hittablelist.h"
+#include "camera.h"
+#include "bvh.h"
+#include "scenes.h"
+#include "tonemap.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "external/stb_image_write.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct headless_options {
+	std::string scene = "cornell";
+	std::string output = "render.png";
+	int spp = -1; //-1 keeps the scene's own settings
+	int pass = -1; //samples per render call, -1 renders all of them in one pass
+	double adaptive = -1; //noise threshold, -1 samples every pixel uniformly
+	int depth = -1;
+	int width = -1;
+	int threads = -1;
+	int seed = -1;
+	std::string bvh; //empty keeps bvh_tree::default_layout
+	int packets = -1; //-1 keeps the camera's setting
+	std::string aovs; //path prefix of the output variable images, empty writes none
+	tonemap_settings tonemap;
+};
+
+static void print_usage(const char* program)
+{
+	std::cout << "usage: " << program << " [options]\n"
+		<< "  --scene <normal|normal2|cornell|triangle>  scene to render (cornell)\n"
+		<< "  --spp <n>        samples per pixel\n"
+		<< "  --pass <n>       samples per progressive pass (all)\n"
+		<< "  --adaptive <t>   stop sampling tiles once their relative noise is below t, e.g. 0.01\n"
+		<< "  --depth <n>      maximum bounces\n"
+		<< "  --width <n>      image width, height follows the scene's aspect ratio\n"
+		<< "  --threads <n>    worker threads, 0 renders on the calling thread\n"
+		<< "  --seed <n>       sampling seed\n"
+		<< "  --bvh <binary|bvh4|bvh8>  BVH layout\n"
+		<< "  --packets <0|1>  trace camera rays as packets of 8\n"
+		<< "  --output <path>  .png, .jpg, .bmp or .hdr (render.png), .hdr keeps the linear radiance\n"
+		<< "  --exposure <stops>  scale the radiance by 2^stops before tone mapping (0)\n"
+		<< "  --tonemap <clamp|reinhard|aces>  tone mapping operator (clamp)\n"
+		<< "  --aovs <prefix>  also write albedo, normal, depth, ids and sample counts as <prefix>_<name>.pfm\n";
+}
+
+static bool parse_options(int argc, char** argv, headless_options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h") return false;
+		if (i + 1 >= argc)
+		{
+			std::cout << "missing value for " << arg << "\n";
+			return false;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "--scene") options.scene = value;
+		else if (arg == "--output" || arg == "-o") options.output = value;
+		else if (arg == "--spp") options.spp = std::atoi(value.c_str());
+		else if (arg == "--pass") options.pass = std::atoi(value.c_str());
+		else if (arg == "--adaptive") options.adaptive = std::atof(value.c_str());
+		else if (arg == "--depth") options.depth = std::atoi(value.c_str());
+		else if (arg == "--width") options.width = std::atoi(value.c_str());
+		else if (arg == "--threads") options.threads = std::atoi(value.c_str());
+		else if (arg == "--seed") options.seed = std::atoi(value.c_str());
+		else if (arg == "--bvh") options.bvh = value;
+		else if (arg == "--packets") options.packets = std::atoi(value.c_str());
+		else if (arg == "--aovs") options.aovs = value;
+		else if (arg == "--exposure") options.tonemap.exposure = (float)std::atof(value.c_str());
+		else if (arg == "--tonemap")
+		{
+			if (!parse_tonemap_operator(value, options.tonemap.op))
+			{
+				std::cout << "unknown tone mapping operator " << value << "\n";
+				return false;
+			}
+		}
+		else
+		{
+			std::cout << "unknown option " << arg << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// pixels is linear radiance, written as is to .hdr and tone mapped to 8 bits for the other formats.
+static bool write_image(const std::string& path, int width, int height, const std::vector<float>& pixels, const tonemap_settings& settings)
+{
+	std::string extension = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+	if (extension == ".hdr")
+		return stbi_write_hdr(path.c_str(), width, height, 3, pixels.data()) != 0;
+
+	std::vector<float> display(pixels.size());
+	tonemap(pixels.data(), display.data(), pixels.size(), settings);
+	std::vector<unsigned char> data(pixels.size());
+	quantize(display.data(), data.data(), data.size());
+
+	if (extension == ".jpg")
+		return stbi_write_jpg(path.c_str(), width, height, 3, data.data(), 95) != 0;
+	if (extension == ".bmp")
+		return stbi_write_bmp(path.c_str(), width, height, 3, data.data()) != 0;
+	return stbi_write_png(path.c_str(), width, height, 3, data.data(), width * 3) != 0;
+}
+
+int main(int argc, char** argv)
+{
+	headless_options options;
+	if (!parse_options(argc, argv, options))
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	using clock = std::chrono::steady_clock;
+	auto seconds_since = [](clock::time_point start) {
+		return std::chrono::duration<double>(clock::now() - start).count();
+	};
+
+	if (!options.bvh.empty() && !parse_bvh_layout(options.bvh, bvh_tree::default_layout))
+	{
+		std::cout << "unknown BVH layout " << options.bvh << "\n";
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	camera cam;
+	default_camera(cam);
+	if (options.threads >= 0)
+	{
+		cam.multithreading = options.threads > 0;
+		cam.threadsize = options.threads > 0 ? options.threads : 1;
+	}
+
+	hittable_list world;
+	auto scene_start = clock::now();
+	try
+	{
+		if (!load_scene(options.scene, world, cam))
+		{
+			std::cout << "unknown scene " << options.scene << "\n";
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "failed loading scene " << options.scene << ": " << e.what() << "\n";
+		return 1;
+	}
+	double scene_time = seconds_since(scene_start);
+
+	if (options.spp > 0) cam.samples_per_pixel = options.spp;
+	if (options.depth > 0) cam.max_depth = options.depth;
+	if (options.width > 0) cam.image_width = options.width;
+	if (options.seed >= 0) cam.seedMultiplier = options.seed;
+	if (options.packets >= 0) cam.packet_tracing = options.packets != 0;
+	if (options.adaptive > 0)
+	{
+		cam.adaptive_sampling = true;
+		cam.adaptive_threshold = options.adaptive;
+	}
+
+	auto world_root = make_shared<bvh_node>(world, &cam.workers());
+	hittable_list world_bvh(world_root);
+
+	cam.initialize();
+	const int width = cam.image_width;
+	const int height = cam.image_height;
+	std::vector<float> pixels((size_t)width * height * 3, 0.0f);
+
+	std::cout << "rendering " << options.scene << " at " << width << "x" << height << ", "
+		<< cam.samples_per_pixel << " spp, " << cam.max_depth << " bounces, "
+		<< (cam.multithreading ? cam.threadsize : 0) << " threads, " << bvh_layout_name(bvh_tree::default_layout) << " BVH\n";
+
+	auto render_start = clock::now();
+	//adaptive sampling needs several passes to find out which tiles are done
+	int pass = cam.adaptive_sampling ? cam.adaptive_min_samples : cam.samples_per_pixel;
+	cam.samples_per_pass = options.pass > 0 ? options.pass : pass;
+	cam.reset_accumulation();
+	cam.stats->reset();
+	while (cam.needs_samples())
+	{
+		cam.render(world_bvh);
+	}
+	cam.resolve(pixels.data());
+	double render_time = seconds_since(render_start);
+
+	double samples = (double)cam.stats->primary_rays;
+	std::cout << "scene setup  " << scene_time << " s\n"
+		<< "bvh build    " << world_root->build_time() << " s\n"
+		<< "render       " << render_time << " s\n"
+		<< "samples      " << samples / ((double)width * height) << " per pixel on average";
+	if (cam.adaptive_sampling)
+		std::cout << ", " << cam.converged_fraction() * 100 << "% of tiles converged";
+	std::cout << "\n"
+		<< "throughput   " << samples / render_time / 1e6 << " Msamples/s\n";
+
+	if (!write_image(options.output, width, height, pixels, options.tonemap))
+	{
+		std::cout << "failed writing " << options.output << "\n";
+		return 1;
+	}
+	std::cout << "wrote " << options.output << "\n";
+
+	if (!options.aovs.empty())
+	{
+		struct aov_file { const char* name; int first; int count; bool mean; };
+		const aov_file files[] = {
+			{ "albedo", aov_albedo_r, 3, true },
+			{ "normal", aov_normal_x, 3, true },
+			{ "depth", aov_depth, 1, false },
+			{ "object_id", aov_object_id, 1, false },
+			{ "primitive_id", aov_primitive_id, 1, false },
+			{ "sample_count", aov_sample_count, 1, false },
+		};
+		for (const aov_file& file : files)
+		{
+			std::string path = options.aovs + "_" + file.name + ".pfm";
+			if (!cam.aovs().write_pfm(path, file.first, file.count, file.mean))
+			{
+				std::cout << "failed writing " << path << "\n";
+				return 1;
+			}
+			std::cout << "wrote " << path << "\n";
+		}
+	}
+	return 0;
+}